@@ -1,19 +1,103 @@
 #include "arc.h"
 #include <ctype.h>
-
-char *error_string[] = { "", "Syntax error", "Symbol not bound", "Wrong number of arguments", "Wrong type", "File error", "" };
-size_t stack_capacity = 0;
-size_t stack_size = 0;
-atom *stack = NULL;
-struct pair *pair_head = NULL;
-struct str *str_head = NULL;
-struct table *table_head = NULL;
-size_t alloc_count = 0;
-size_t alloc_count_old = 0;
-char **symbol_table = NULL;
+#include <errno.h>
+
+char *error_string[] = { "", "Syntax error", "Symbol not bound", "Wrong number of arguments", "Wrong type", "File error", "", "Out of memory" };
+struct root_frame *roots = NULL; /* innermost frame of C locals */
+/* young objects allocated since the last collection */
+size_t nursery_count = 0;
+/* incremental collector, selected at startup */
+int gc_incremental = 0;
+/* major collections copy the pairs together, selected at startup */
+int gc_compacting = 0;
+char *gc_stack_bottom = NULL; /* set by main. Compaction needs it. */
+/* slabs the pairs are copied to */
+struct slab **copy_slabs = NULL;
+size_t copy_slab_count = 0;
+size_t copy_slab_capacity = 0;
+size_t copy_index = 0; /* next slot of the last copy slab */
+/* heap profiler, enabled by giving it a file */
+char *heap_profile = NULL;
+struct heap_site *heap_sites = NULL; /* the first is top level code */
+size_t heap_site_count = 0;
+size_t heap_site_capacity = 0;
+uint32_t *heap_site_index = NULL; /* hash of name pointers to heap_sites + 1 */
+size_t heap_site_index_capacity = 0;
+uint32_t heap_site = 0; /* of the function being evaluated */
+size_t heap_profile_number = 0; /* collections profiled */
+volatile sig_atomic_t heap_dump_requested = 0; /* by SIGUSR1 */
+int gc_huge_pages = 0; /* transparent huge pages for the arenas */
+/* Released slabs, their pages returned to the OS. They are listed outside
+ * the slabs so that their pages stay unused. */
+struct slab **free_slabs = NULL;
+size_t free_slab_count = 0;
+size_t free_slab_capacity = 0;
+size_t gc_threads = 1; /* marking threads of major collections */
+#ifdef GC_PARALLEL
+struct gc_worker *gc_workers = NULL; /* the main thread is the first */
+pthread_mutex_t gc_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gc_pool_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t gc_pool_done = PTHREAD_COND_INITIALIZER;
+unsigned long gc_pool_epoch = 0; /* counts the parallel mark phases */
+size_t gc_pool_running = 0; /* pool threads still marking */
+size_t gc_idle_workers = 0; /* threads that found no work to steal */
+#endif
+int gc_background_sweep = 0; /* the sweeper thread sweeps pairs and strings */
+#ifdef GC_PARALLEL
+pthread_t sweeper;
+pthread_mutex_t sweep_lock = PTHREAD_MUTEX_INITIALIZER; /* of the pending and swept lists */
+pthread_cond_t sweep_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t sweep_idle = PTHREAD_COND_INITIALIZER;
+int sweeper_started = 0;
+int sweeper_paused = 0; /* by a collection */
+int sweeper_busy = 0; /* sweeping a slab */
+#endif
+size_t gc_budget = 10000; /* least objects marked or swept per slice */
+long gc_pause = 0; /* microseconds per slice, 0 for no limit */
+enum { GC_IDLE, GC_MARKING, GC_SWEEPING } gc_phase = GC_IDLE;
+atom *gray = NULL; /* marked objects whose children are not traced yet */
+size_t gray_size = 0;
+size_t gray_capacity = 0;
+size_t sweep_class; /* class being swept by the incremental collector */
+/* weak tables scanned by the current collection */
+struct table **weak_tables = NULL;
+size_t weak_size = 0;
+size_t weak_capacity = 0;
+#ifdef GC_PARALLEL
+pthread_mutex_t weak_lock = PTHREAD_MUTEX_INITIALIZER; /* of weak_tables while marking in parallel */
+#endif
+/* old objects written since the last collection */
+atom *remembered = NULL;
+size_t remembered_size = 0;
+size_t remembered_capacity = 0;
+/* bytes of the objects, string contents and table buckets, without the
+ * dead objects found by the last collection */
+size_t heap_bytes = 0;
+size_t open_ports = 0; /* opened by Arc code and not closed yet */
+size_t payload_bytes = 0; /* held outside the slabs by strings, tables and bignums */
+size_t marked_payload = 0; /* of the marked objects */
+size_t gc_threshold = 0; /* heap_bytes that starts a major collection */
+double gc_growth = 2; /* of the heap left by a major collection */
+size_t gc_min_heap = 4 << 20; /* lowest threshold */
+size_t gc_max_heap = (size_t)-1; /* hard limit of heap_bytes */
+/* gc_max_heap, raised by a reserve for error handlers while the heap is
+ * over it */
+size_t heap_limit = (size_t)-1;
+size_t slice_heap_bytes = 0; /* heap_bytes at the last incremental slice */
+size_t gc_work_left = 0; /* estimated work of the incremental cycle */
+struct symbol **symbol_table = NULL; /* open addressing, by name */
 size_t symbol_size = 0;
-size_t symbol_capacity = 0;
+size_t symbol_capacity = 0; /* a power of two */
+struct symbol **uniq_symbols = NULL; /* uninterned */
+size_t uniq_size = 0, uniq_capacity = 0;
+size_t uniq_count = 0;
+struct big_power *big_powers = NULL; /* for decimal conversion */
+size_t big_power_count = 0;
+#ifdef NANBOX
+const atom nil = NANBOX_NIL;
+#else
 const atom nil = { T_NIL };
+#endif
 atom env; /* the global environment */
 /* symbols for faster execution */
 atom sym_t, sym_quote, sym_quasiquote, sym_unquote, sym_unquote_splicing, sym_assign, sym_fn, sym_if, sym_mac, sym_apply, sym_cons, sym_sym, sym_string, sym_num, sym__, sym_o, sym_table, sym_int, sym_char, sym_do;
@@ -67,47 +151,400 @@ void atom_to_vector(atom a, struct vector *v) {
 	}
 }
 
-void stack_add(atom a) {
-	switch (a.type) {
-	case T_CONS:
-	case T_CLOSURE:
-	case T_MACRO:
-	case T_STRING:
-	case T_TABLE:
-		break;
-	default:
+void root_frame_push(struct root_frame *f) {
+	size_t i;
+	for (i = 0; i < ROOT_SLOTS; i++) {
+		f->atoms[i] = NULL;
+	}
+	f->vector = NULL;
+	f->prev = roots;
+	roots = f;
+}
+
+/* Paces major collections by the bytes left by the last one. Called when
+ * marking is done, so heap_bytes holds only the marked objects. */
+void gc_set_threshold()
+{
+	double t = heap_bytes * gc_growth;
+	gc_threshold = t < gc_min_heap ? gc_min_heap : (size_t)t;
+}
+
+void consider_gc() {
+	if (gc_incremental) {
+		size_t budget = gc_budget, grown = 0, limit, work;
+		if (heap_bytes > slice_heap_bytes) grown = heap_bytes - slice_heap_bytes;
+		if (nursery_count < GC_SLICE_ALLOC && grown < GC_SLICE_BYTES) return;
+		nursery_count = 0;
+		slice_heap_bytes = heap_bytes;
+		if (gc_phase == GC_IDLE) {
+			if (heap_bytes <= gc_threshold) return;
+			gc_begin_cycle();
+		}
+		/* past twice the threshold, the cycle ends without a budget */
+		if (heap_bytes / 2 > gc_threshold) {
+			gc();
+			slice_heap_bytes = heap_bytes;
+			return;
+		}
+		/* The slice does the share of the work left that the allocation
+		 * took of the room left, so that the cycle ends before the heap
+		 * passes the threshold by half. */
+		limit = gc_threshold + gc_threshold / 2;
+		if (heap_bytes >= limit) gc_budget = (size_t)-1;
+		else {
+			work = (size_t)((double)gc_work_left * grown / (limit - heap_bytes));
+			if (work > gc_budget) gc_budget = work;
+		}
+		work = gc_step();
+		gc_work_left -= work < gc_work_left ? work : gc_work_left;
+		gc_budget = budget;
+		slice_heap_bytes = heap_bytes; /* the slice may have found garbage */
 		return;
 	}
-	stack_size++;
-	if (stack_size > stack_capacity) {
-		stack_capacity = stack_size * 2;
-		stack = realloc(stack, stack_capacity * sizeof(atom));
+	/* a large string or table may pass the threshold before the nursery
+	 * fills up */
+	if (nursery_count < GC_NURSERY_SIZE && heap_bytes <= gc_threshold) return;
+	if (heap_bytes > gc_threshold)
+		gc();
+	else
+		gc_minor();
+}
+
+/* Links the free slots of the slab in address order. */
+void slab_rebuild_free(struct slab *s)
+{
+	size_t w, words = (s->cls->count + 63) / 64;
+	void **tail = &s->free;
+	for (w = 0; w < words; w++) {
+		uint64_t f = ~s->alloc[w];
+		if (w == words - 1 && s->cls->count % 64)
+			f &= ((uint64_t)1 << (s->cls->count % 64)) - 1;
+		while (f) {
+			void *obj = slab_object(s, w * 64 + ctz64(f));
+			*tail = obj;
+			tail = obj;
+			f &= f - 1;
+		}
+	}
+	*tail = NULL;
+}
+
+#ifdef GC_MMAP
+void slab_list_free(struct slab *s)
+{
+	free_slab_count++;
+	if (free_slab_count > free_slab_capacity) {
+		free_slab_capacity = free_slab_count * 2;
+		free_slabs = realloc(free_slabs, free_slab_capacity * sizeof(struct slab *));
 	}
-	stack[stack_size - 1] = a;
+	free_slabs[free_slab_count - 1] = s;
 }
 
-void stack_restore(int saved_size) {
-	stack_size = saved_size;
-	/* if there is waste of memory, realloc */
-	if (stack_size < stack_capacity / 4) {
-		stack_capacity = stack_size * 2;
-		stack = realloc(stack, stack_capacity * sizeof(atom));
+/* Takes a released slab, or maps a new ARENA_SIZE-aligned arena. */
+struct slab *slab_map()
+{
+	if (!free_slab_count) {
+		char *p, *arena;
+		size_t i;
+		p = mmap(NULL, 2 * ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) return NULL;
+		arena = (char *)(((uintptr_t)p + ARENA_SIZE - 1) & ~(uintptr_t)(ARENA_SIZE - 1));
+		if (arena > p) munmap(p, arena - p);
+		munmap(arena + ARENA_SIZE, p + ARENA_SIZE - arena);
+#ifdef MADV_HUGEPAGE
+		if (gc_huge_pages) madvise(arena, ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+		for (i = ARENA_SIZE / SLAB_SIZE; i-- > 0;) {
+			slab_list_free((struct slab *)(arena + i * SLAB_SIZE));
+		}
 	}
+	return free_slabs[--free_slab_count];
 }
+#endif
 
-void stack_restore_add(int saved_size, atom a) {
-	stack_size = saved_size;
-	/* if there is waste of memory, realloc */
-	if (stack_size < stack_capacity / 4) {
-		stack_capacity = stack_size * 2;
-		stack = realloc(stack, stack_capacity * sizeof(atom));
+struct slab *slab_new(struct slab_class *cls)
+{
+	struct slab *s;
+#ifdef GC_MMAP
+	s = slab_map();
+#elif defined(_MSC_VER)
+	s = _aligned_malloc(SLAB_SIZE, SLAB_SIZE);
+#else
+	if (posix_memalign((void **)&s, SLAB_SIZE, SLAB_SIZE)) s = NULL;
+#endif
+	if (!s) {
+		fputs("Out of memory\n", stderr);
+		abort();
+	}
+	if (!cls->count) {
+		if (cls->collected) { /* power-of-two slots for slab_index */
+			cls->shift = 4;
+			while (((size_t)1 << cls->shift) < cls->size) cls->shift++;
+			cls->size = (size_t)1 << cls->shift;
+		}
+		cls->count = (SLAB_SIZE - SLAB_START) / cls->size;
 	}
-	stack_add(a);
+	s->cls = cls;
+	s->live = 0;
+	s->dirty = 0;
+	s->unswept = 0;
+	s->pending = 0;
+	s->pinned = 0;
+	s->sites = heap_profile && cls->collected ? calloc(cls->count, sizeof(uint32_t)) : NULL;
+	memset(s->alloc, 0, sizeof(s->alloc));
+	memset(s->mark, 0, sizeof(s->mark));
+	memset(s->remembered, 0, sizeof(s->remembered));
+	slab_rebuild_free(s);
+	s->next = cls->slabs;
+	cls->slabs = s;
+	s->avail = 1;
+	s->next_avail = cls->avail;
+	cls->avail = s;
+	return s;
 }
 
-void consider_gc() {
-	if (alloc_count > 2 * alloc_count_old)
-		gc();
+/* The pages of a released slab go back to the OS but its address space
+ * stays mapped for the next slab. */
+void slab_release(struct slab *s)
+{
+	free(s->sites);
+#ifdef GC_MMAP
+	madvise(s, SLAB_SIZE, MADV_DONTNEED);
+	slab_list_free(s);
+#elif defined(_MSC_VER)
+	_aligned_free(s);
+#else
+	free(s);
+#endif
+}
+
+void slab_make_avail(struct slab *s)
+{
+	if (s->avail) return;
+	s->avail = 1;
+	s->next_avail = s->cls->avail;
+	s->cls->avail = s;
+}
+
+void sweep_lock_acquire()
+{
+#ifdef GC_PARALLEL
+	if (sweeper_started) pthread_mutex_lock(&sweep_lock);
+#endif
+}
+
+void sweep_lock_release()
+{
+#ifdef GC_PARALLEL
+	if (sweeper_started) pthread_mutex_unlock(&sweep_lock);
+#endif
+}
+
+/* Slabs left unswept by the last collection are swept here, when their
+ * space is needed. Objects allocated while the incremental collector is
+ * marking are black. */
+void *slab_alloc(struct slab_class *cls)
+{
+	struct slab *s;
+	void *obj;
+	for (;;) {
+		while ((s = cls->avail) != NULL) {
+			if (s->unswept) slab_sweep(s, gc_incremental);
+			if (s->free) break;
+			cls->avail = s->next_avail; /* drop full slabs */
+			s->avail = 0;
+		}
+		if (s) break;
+		sweep_lock_acquire();
+		if (cls->swept) {
+			while ((s = cls->swept) != NULL) {
+				cls->swept = s->next_pending;
+				slab_make_avail(s);
+			}
+			sweep_lock_release();
+			continue;
+		}
+		s = cls->pending;
+		if (s) {
+			cls->pending = s->next_pending;
+			s->pending = 0;
+		}
+		sweep_lock_release();
+		if (!s) {
+			s = slab_new(cls);
+			break;
+		}
+		if (s->unswept) {
+			slab_sweep(s, gc_incremental);
+			if (s->free) {
+				slab_make_avail(s);
+				break;
+			}
+		}
+	}
+	obj = s->free;
+	s->free = *(void **)obj;
+	s->live++;
+	if (cls->collected) {
+		size_t i = slab_index(s, obj);
+		heap_bytes += cls->size;
+		if (s->sites) s->sites[i] = heap_site;
+		bit_set(s->alloc, i);
+		if (gc_phase == GC_MARKING) bit_set(s->mark, i);
+		if (!s->dirty) {
+			s->dirty = 1;
+			s->next_dirty = cls->dirty;
+			cls->dirty = s;
+		}
+	}
+	return obj;
+}
+
+/* for objects that are freed explicitly instead of being swept */
+void slab_free(void *obj)
+{
+	struct slab *s = slab_of(obj);
+	*(void **)obj = s->free;
+	s->free = obj;
+	s->live--;
+	slab_make_avail(s);
+}
+
+void str_finalize(void *obj)
+{
+	struct str *s = obj;
+	if (s->capacity) free(s->value);
+}
+
+void bignum_finalize(void *obj)
+{
+	free(((struct bignum *)obj)->digit);
+}
+
+void table_finalize(void *obj)
+{
+	struct table *at = obj;
+	size_t i;
+	for (i = 0; i < at->capacity; i++) {
+		struct table_entry *e = at->data[i];
+		while (e) {
+			struct table_entry *next = e->next;
+			slab_free(e);
+			e = next;
+		}
+	}
+	free(at->data);
+}
+
+void port_close(struct port *p)
+{
+	if (!p->fp) return;
+	if (p->pipe)
+		pclose(p->fp);
+	else
+		fclose(p->fp);
+	p->fp = NULL;
+	if (p->owned) open_ports--;
+}
+
+void port_finalize(void *obj)
+{
+	struct port *p = obj;
+	if (p->owned) port_close(p);
+}
+
+struct slab_class pair_class = { sizeof(struct pair), 1 };
+struct slab_class str_class = { sizeof(struct str), 1, str_finalize };
+struct slab_class table_class = { sizeof(struct table), 1, table_finalize };
+struct slab_class entry_class = { sizeof(struct table_entry), 0 };
+struct slab_class port_class = { sizeof(struct port), 1, port_finalize };
+struct slab_class bignum_class = { sizeof(struct bignum), 1, bignum_finalize };
+struct slab_class *swept_classes[] = { &pair_class, &str_class, &table_class, &port_class, &bignum_class };
+#define SWEPT_CLASSES (sizeof(swept_classes) / sizeof(swept_classes[0]))
+/* Tables are swept by the mutator, since their finalizer frees entries
+ * into a class that it allocates from without the lock, and so are ports,
+ * whose finalizer updates open_ports. */
+struct slab_class *sweeper_classes[] = { &pair_class, &str_class, &bignum_class };
+#define SWEEPER_CLASSES (sizeof(sweeper_classes) / sizeof(sweeper_classes[0]))
+
+#ifdef GC_PARALLEL
+/* Sweeps the pending slabs of the sweeper classes while the mutator runs.
+ * The mutator allocates only from swept slabs, and sweeps a pending slab
+ * itself when the sweeper has not reached one yet. */
+void *gc_sweeper_main(void *arg)
+{
+	struct slab *s;
+	size_t i;
+	(void)arg;
+	pthread_mutex_lock(&sweep_lock);
+	for (;;) {
+		s = NULL;
+		for (i = 0; i < SWEEPER_CLASSES && !s && !sweeper_paused; i++) {
+			struct slab_class *cls = sweeper_classes[i];
+			if ((s = cls->pending) != NULL) {
+				cls->pending = s->next_pending;
+				s->pending = 0;
+			}
+		}
+		if (!s) {
+			pthread_cond_wait(&sweep_wake, &sweep_lock);
+			continue;
+		}
+		sweeper_busy = 1;
+		pthread_mutex_unlock(&sweep_lock);
+		if (s->unswept) slab_sweep(s, 0);
+		pthread_mutex_lock(&sweep_lock);
+		sweeper_busy = 0;
+		if (s->free) {
+			s->next_pending = s->cls->swept;
+			s->cls->swept = s;
+		}
+		pthread_cond_signal(&sweep_idle);
+	}
+	return NULL;
+}
+#endif
+
+/* Stops the sweeper thread while a collection changes the slab lists. */
+void gc_sweeper_pause()
+{
+#ifdef GC_PARALLEL
+	if (!sweeper_started) return;
+	pthread_mutex_lock(&sweep_lock);
+	sweeper_paused = 1;
+	while (sweeper_busy) pthread_cond_wait(&sweep_idle, &sweep_lock);
+	pthread_mutex_unlock(&sweep_lock);
+#endif
+}
+
+/* Hands the slabs queued by a collection to the sweeper thread, which is
+ * started by the first collection. */
+void gc_sweeper_resume()
+{
+#ifdef GC_PARALLEL
+	size_t i;
+	if (!gc_background_sweep || gc_incremental) return;
+	for (i = 0; i < SWEEPER_CLASSES; i++) { /* unswept slabs are pending */
+		struct slab *s, **ps = &sweeper_classes[i]->avail;
+		while ((s = *ps) != NULL) {
+			if (s->unswept) {
+				s->avail = 0;
+				*ps = s->next_avail;
+			}
+			else {
+				ps = &s->next_avail;
+			}
+		}
+	}
+	if (!sweeper_started) {
+		if (pthread_create(&sweeper, NULL, gc_sweeper_main, NULL)) return; /* stay lazy */
+		sweeper_started = 1;
+	}
+	pthread_mutex_lock(&sweep_lock);
+	sweeper_paused = 0;
+	pthread_cond_signal(&sweep_wake);
+	pthread_mutex_unlock(&sweep_lock);
+#endif
 }
 
 atom cons(atom car_val, atom cdr_val)
@@ -115,177 +552,2160 @@ atom cons(atom car_val, atom cdr_val)
 	struct pair *a;
 	atom p;
 
-	alloc_count++;
+	nursery_count++;
 
-	a = malloc(sizeof(struct pair));
-	a->mark = 0;
-	a->next = pair_head;
-	pair_head = a;
+	a = slab_alloc(&pair_class);
+	if (gc_phase == GC_MARKING) { /* a is black */
+		gc_shade(car_val);
+		gc_shade(cdr_val);
+	}
 
-	p.type = T_CONS;
-	p.value.pair = a;
+	p = atom_of(T_CONS, pair, a);
 
 	car(p) = car_val;
 	cdr(p) = cdr_val;
 
-	stack_add(p);
-
 	return p;
 }
 
-void gc_mark(atom root)
+/* Returns the collected object of the atom, or NULL. */
+void *heap_object(atom a)
 {
-	struct pair *a;
-	struct str *as;
-	struct table *at;
-start:
-	switch (root.type) {
+	switch (atom_type(a)) {
 	case T_CONS:
 	case T_CLOSURE:
 	case T_MACRO:
-		a = root.value.pair;
-		if (a->mark) return;
-		a->mark = 1;
-		gc_mark(car(root));
-		/* reduce recursion */
-		root = cdr(root);
-		goto start;
-		break;
+		return atom_pair(a);
 	case T_STRING:
-		as = root.value.str;
-		if (as->mark) return;
-		as->mark = 1;
-		break;
-	case T_TABLE: {
-		at = root.value.table;
-		if (at->mark) return;
-		at->mark = 1;
-		size_t i;
-		for (i = 0; i < at->capacity; i++) {
-			struct table_entry *e = at->data[i];
-			while (e) {
-				gc_mark(e->k);
-				gc_mark(e->v);
-				e = e->next;
-			}
-		}
-		break; }
+		return atom_str(a);
+	case T_TABLE:
+		return atom_table(a);
+	case T_INPUT:
+	case T_INPUT_PIPE:
+	case T_OUTPUT:
+		return atom_port(a);
+	case T_BIGNUM:
+		return atom_bignum(a);
 	default:
+		return NULL;
+	}
+}
+
+/* Old objects keep their mark between collections, so a minor collection
+ * stops tracing at them. Storing into an old object must remember it, because
+ * it may now be the only path to a young object. */
+void gc_write_barrier(atom obj)
+{
+	void *p;
+	struct slab *s;
+	size_t i;
+	if (atom_type(obj) == T_STRING || atom_type(obj) == T_BIGNUM || !(p = heap_object(obj))) return;
+	s = slab_of(p);
+	i = slab_index(s, p);
+	/* young, or already remembered */
+	if (!bit_test(s->mark, i) || bit_test(s->remembered, i)) return;
+	if (gc_incremental) {
+		/* A black object may now point to a white one, so make it gray
+		 * again. The incremental collector has no generations. */
+		if (gc_phase != GC_MARKING) return;
+		bit_set(s->remembered, i);
+		gray_push(obj);
 		return;
 	}
+	bit_set(s->remembered, i);
+	remembered_size++;
+	if (remembered_size > remembered_capacity) {
+		remembered_capacity = remembered_size * 2;
+		remembered = realloc(remembered, remembered_capacity * sizeof(atom));
+	}
+	remembered[remembered_size - 1] = obj;
 }
 
-void gc()
+void gray_push(atom a)
+{
+	gray_size++;
+	if (gray_size > gray_capacity) {
+		gray_capacity = gray_size * 2;
+		gray = realloc(gray, gray_capacity * sizeof(atom));
+	}
+	gray[gray_size - 1] = a;
+}
+
+int gc_marked(void *p)
+{
+	struct slab *s = slab_of(p);
+	return bit_test(s->mark, slab_index(s, p));
+}
+
+/* Accounts bytes that a string or table holds outside its slab. */
+void gc_account(void *obj, size_t bytes)
+{
+	heap_bytes += bytes;
+	payload_bytes += bytes;
+	if (gc_marked(obj)) marked_payload += bytes;
+}
+
+size_t table_payload(struct table *at)
+{
+	return at->capacity * sizeof(struct table_entry *) + at->size * sizeof(struct table_entry);
+}
+
+/* After marking, the unmarked strings and tables are dead. Their contents
+ * are freed by the sweep but no longer count towards the heap. */
+void gc_account_garbage()
 {
-	struct pair *a, **p;
-	struct str *as, **ps;
-	struct table *at, **pt;
+	heap_bytes -= payload_bytes - marked_payload;
+	payload_bytes = marked_payload;
+}
 
-	/* mark atoms in the stack */
+/* white -> gray. Only the mark bitmap is written. */
+void gc_shade(atom a)
+{
+	void *p = heap_object(a);
+	struct slab *s;
 	size_t i;
-	for (i = 0; i < stack_size; i++) {
-		gc_mark(stack[i]);
+	if (atom_type(a) == T_SYM) symbol_of(atom_symbol(a))->mark = 1;
+	if (!p) return;
+	s = slab_of(p);
+	i = slab_index(s, p);
+	if (bit_test(s->mark, i)) return;
+	bit_set(s->mark, i);
+	if (atom_type(a) == T_STRING) {
+		marked_payload += atom_str(a)->capacity;
+		if (str_slice(atom_str(a))) gc_shade(atom_of(T_STRING, str, atom_str(a)->parent));
+		return;
 	}
+	if (atom_type(a) == T_BIGNUM) {
+		marked_payload += atom_bignum(a)->size * sizeof(uint32_t);
+		return;
+	}
+	if (is_port(a)) return;
+	if (atom_type(a) == T_TABLE) marked_payload += table_payload(atom_table(a));
+	prefetch(p);
+	gray_push(a);
+}
 
-	alloc_count_old = 0;
-	/* Free unmarked "cons" allocations */
-	p = &pair_head;
-	while (*p != NULL) {
-		a = *p;
-		if (!a->mark) {
-			*p = a->next;
-			free(a);
-		}
-		else {
-			p = &a->next;
-			a->mark = 0; /* clear mark */
-			alloc_count_old++;
-		}
+/* Non-heap atoms other than symbols are always live. */
+int gc_live(atom a)
+{
+	void *p = heap_object(a);
+	if (atom_type(a) == T_SYM) return symbol_of(atom_symbol(a))->mark;
+	return !p || gc_marked(p);
+}
+
+void weak_table_push(struct table *at)
+{
+	weak_size++;
+	if (weak_size > weak_capacity) {
+		weak_capacity = weak_size * 2;
+		weak_tables = realloc(weak_tables, weak_capacity * sizeof(struct table *));
 	}
+	weak_tables[weak_size - 1] = at;
+}
 
-	/* Free unmarked "string" allocations */
-	ps = &str_head;
-	while (*ps != NULL) {
-		as = *ps;
-		if (!as->mark) {
-			*ps = as->next;
-			free(as->value);
-			free(as);
-		}
-		else {
-			ps = &as->next;
-			as->mark = 0; /* clear mark */
-			alloc_count_old++;
+/* gray -> black. Returns the amount of work done. */
+size_t gc_scan(atom a)
+{
+	struct slab *s = slab_of(atom_pair(a));
+	bit_clear(s->remembered, slab_index(s, atom_pair(a)));
+	if (atom_type(a) == T_TABLE) {
+		struct table *at = atom_table(a);
+		size_t i, n = 1;
+		if (at->weak) weak_table_push(at);
+		for (i = 0; i < at->capacity; i++) {
+			struct table_entry *e;
+			for (e = at->data[i]; e; e = e->next) {
+				if (at->weak != TABLE_WEAK_KEYS) gc_shade(e->k);
+				if (!at->weak || (at->weak == TABLE_WEAK_KEYS && gc_live(e->k))) gc_shade(e->v);
+				n++;
+			}
 		}
+		return n;
 	}
+	gc_shade(car(a));
+	gc_shade(cdr(a));
+	return 1;
+}
 
-	/* Free unmarked "table" allocations */
-	pt = &table_head;
-	while (*pt != NULL) {
-		at = *pt;
-		if (!at->mark) {
-			*pt = at->next;
-			size_t i;
-			for (i = 0; i < at->capacity; i++) {
-				struct table_entry *e = at->data[i];
-				while (e) {
-					struct table_entry *next = e->next;
-					free(e);
-					e = next;
+long gc_now()
+{
+#ifdef _MSC_VER
+	return (long)(clock() * (1000000.0 / CLOCKS_PER_SEC));
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+#endif
+}
+
+/* Returns nonzero when the slice has used up its budget. */
+int gc_slice_over(size_t work, long start)
+{
+	if (work >= gc_budget) return 1;
+	return gc_pause > 0 && (work & 255) == 0 && gc_now() - start >= gc_pause;
+}
+
+/* Traces the gray objects until none is left. The gray stack grows as
+ * needed, so deep structures do not overflow the C stack. */
+void gc_drain()
+{
+	while (gray_size) {
+		atom a = gray[--gray_size];
+		if (gray_size) prefetch(atom_pair(gray[gray_size - 1]));
+		gc_scan(a);
+	}
+}
+
+void gc_mark(atom root)
+{
+	gc_shade(root);
+	gc_drain();
+}
+
+#ifdef GC_PARALLEL
+void gc_worker_push(struct gc_worker *w, atom a)
+{
+	w->gray_size++;
+	if (w->gray_size > w->gray_capacity) {
+		w->gray_capacity = w->gray_size * 2;
+		w->gray = realloc(w->gray, w->gray_capacity * sizeof(atom));
+	}
+	w->gray[w->gray_size - 1] = a;
+}
+
+/* Moves up to n gray objects from the top of one stack to another. */
+void gc_move_gray(atom *from, size_t *from_size, atom **to, size_t *to_size, size_t *to_capacity, size_t n)
+{
+	if (n > *from_size) n = *from_size;
+	if (*to_size + n > *to_capacity) {
+		*to_capacity = (*to_size + n) * 2;
+		*to = realloc(*to, *to_capacity * sizeof(atom));
+	}
+	/* the sizes of shared stacks are read without the lock */
+	__atomic_store_n(from_size, *from_size - n, __ATOMIC_RELAXED);
+	memcpy(*to + *to_size, from + *from_size, n * sizeof(atom));
+	__atomic_store_n(to_size, *to_size + n, __ATOMIC_RELAXED);
+}
+
+/* gc_shade for a marking thread. The mark bit is set atomically, so only
+ * one thread scans each object. */
+void gc_worker_shade(struct gc_worker *w, atom a)
+{
+	void *p = heap_object(a);
+	struct slab *s;
+	size_t i;
+	uint64_t bit;
+	if (atom_type(a) == T_SYM) __atomic_store_n(&symbol_of(atom_symbol(a))->mark, 1, __ATOMIC_RELAXED);
+	if (!p) return;
+	s = slab_of(p);
+	i = slab_index(s, p);
+	bit = (uint64_t)1 << (i & 63);
+	if (__atomic_load_n(&s->mark[i >> 6], __ATOMIC_RELAXED) & bit) return;
+	if (__atomic_fetch_or(&s->mark[i >> 6], bit, __ATOMIC_RELAXED) & bit) return;
+	if (atom_type(a) == T_STRING) {
+		w->marked_payload += atom_str(a)->capacity;
+		if (str_slice(atom_str(a))) gc_worker_shade(w, atom_of(T_STRING, str, atom_str(a)->parent));
+		return;
+	}
+	if (atom_type(a) == T_BIGNUM) {
+		w->marked_payload += atom_bignum(a)->size * sizeof(uint32_t);
+		return;
+	}
+	if (is_port(a)) return;
+	if (atom_type(a) == T_TABLE) w->marked_payload += table_payload(atom_table(a));
+	prefetch(p);
+	gc_worker_push(w, a);
+	/* keep some work where idle threads can steal it */
+	if (w->gray_size > 2 * GC_STEAL_CHUNK && __atomic_load_n(&w->shared_size, __ATOMIC_RELAXED) == 0) {
+		pthread_mutex_lock(&w->lock);
+		gc_move_gray(w->gray, &w->gray_size, &w->shared, &w->shared_size, &w->shared_capacity, GC_STEAL_CHUNK);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+/* gc_live for a marking thread. */
+int gc_worker_live(atom a)
+{
+	void *p = heap_object(a);
+	struct slab *s;
+	size_t i;
+	if (atom_type(a) == T_SYM) return __atomic_load_n(&symbol_of(atom_symbol(a))->mark, __ATOMIC_RELAXED);
+	if (!p) return 1;
+	s = slab_of(p);
+	i = slab_index(s, p);
+	return (__atomic_load_n(&s->mark[i >> 6], __ATOMIC_RELAXED) >> (i & 63)) & 1;
+}
+
+/* Takes half of the shared gray objects of a victim. */
+int gc_steal(struct gc_worker *w, struct gc_worker *victim)
+{
+	size_t n;
+	if (__atomic_load_n(&victim->shared_size, __ATOMIC_RELAXED) == 0) return 0;
+	pthread_mutex_lock(&victim->lock);
+	n = victim == w ? victim->shared_size : (victim->shared_size + 1) / 2;
+	gc_move_gray(victim->shared, &victim->shared_size, &w->gray, &w->gray_size, &w->gray_capacity, n);
+	pthread_mutex_unlock(&victim->lock);
+	return n > 0;
+}
+
+int gc_steal_any(struct gc_worker *w)
+{
+	size_t i, self = w - gc_workers;
+	for (i = 0; i < gc_threads; i++) {
+		if (gc_steal(w, &gc_workers[(self + i) % gc_threads])) return 1;
+	}
+	return 0;
+}
+
+/* Marks until every thread is out of work. A thread is idle only when its
+ * own objects are all scanned, and only the owner shares its objects, so
+ * once all threads are idle nothing is left to steal. */
+void gc_worker_mark(struct gc_worker *w)
+{
+	size_t i;
+	for (;;) {
+		while (w->gray_size) {
+			atom a = w->gray[--w->gray_size];
+			if (w->gray_size) prefetch(atom_pair(w->gray[w->gray_size - 1]));
+			if (atom_type(a) == T_TABLE) {
+				struct table *at = atom_table(a);
+				if (at->weak) {
+					pthread_mutex_lock(&weak_lock);
+					weak_table_push(at);
+					pthread_mutex_unlock(&weak_lock);
+				}
+				for (i = 0; i < at->capacity; i++) {
+					struct table_entry *e;
+					for (e = at->data[i]; e; e = e->next) {
+						if (at->weak != TABLE_WEAK_KEYS) gc_worker_shade(w, e->k);
+						if (at->weak == TABLE_WEAK_KEYS && !gc_worker_live(e->k)) continue; /* only through a live key */
+						if (at->weak != TABLE_WEAK_VALUES) gc_worker_shade(w, e->v);
+					}
 				}
 			}
-			free(at->data);
-			free(at);
+			else {
+				gc_worker_shade(w, car(a));
+				gc_worker_shade(w, cdr(a));
+			}
 		}
-		else {
-			pt = &at->next;
-			at->mark = 0; /* clear mark */
-			alloc_count_old++;
+		if (gc_steal_any(w)) continue;
+		__atomic_add_fetch(&gc_idle_workers, 1, __ATOMIC_SEQ_CST);
+		for (;;) {
+			if (__atomic_load_n(&gc_idle_workers, __ATOMIC_SEQ_CST) == gc_threads) return;
+			for (i = 0; i < gc_threads; i++) {
+				if (__atomic_load_n(&gc_workers[i].shared_size, __ATOMIC_RELAXED)) break;
+			}
+			if (i < gc_threads) break;
+			sched_yield();
 		}
+		__atomic_sub_fetch(&gc_idle_workers, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+void *gc_worker_main(void *arg)
+{
+	struct gc_worker *w = arg;
+	unsigned long epoch = 0;
+	for (;;) {
+		pthread_mutex_lock(&gc_pool_lock);
+		while (gc_pool_epoch == epoch) pthread_cond_wait(&gc_pool_start, &gc_pool_lock);
+		epoch = gc_pool_epoch;
+		pthread_mutex_unlock(&gc_pool_lock);
+		gc_worker_mark(w);
+		pthread_mutex_lock(&gc_pool_lock);
+		if (--gc_pool_running == 0) pthread_cond_signal(&gc_pool_done);
+		pthread_mutex_unlock(&gc_pool_lock);
+	}
+	return NULL;
+}
+
+/* gc_drain with the pool of marking threads, which is started by the
+ * first parallel collection. */
+void gc_drain_parallel()
+{
+	size_t i;
+	if (!gc_workers) {
+		gc_workers = calloc(gc_threads, sizeof(struct gc_worker));
+		for (i = 0; i < gc_threads; i++) {
+			pthread_mutex_init(&gc_workers[i].lock, NULL);
+			if (i > 0 && pthread_create(&gc_workers[i].thread, NULL, gc_worker_main, &gc_workers[i])) {
+				fputs("Cannot start marking threads\n", stderr);
+				abort();
+			}
+		}
+	}
+	for (i = 0; i < gray_size; i++) {
+		gc_worker_push(&gc_workers[i % gc_threads], gray[i]);
+	}
+	gray_size = 0;
+	gc_idle_workers = 0;
+	pthread_mutex_lock(&gc_pool_lock);
+	gc_pool_running = gc_threads - 1;
+	gc_pool_epoch++;
+	pthread_cond_broadcast(&gc_pool_start);
+	pthread_mutex_unlock(&gc_pool_lock);
+	gc_worker_mark(&gc_workers[0]);
+	pthread_mutex_lock(&gc_pool_lock);
+	while (gc_pool_running) pthread_cond_wait(&gc_pool_done, &gc_pool_lock);
+	pthread_mutex_unlock(&gc_pool_lock);
+	for (i = 0; i < gc_threads; i++) {
+		marked_payload += gc_workers[i].marked_payload;
+		gc_workers[i].marked_payload = 0;
+	}
+}
+#endif
+
+/* Runs after marking. A value of a weak-keys table whose key was marked
+ * after the table was scanned is marked now, which may mark more keys, so
+ * this repeats until nothing changes. Then the entries whose weak side is
+ * unmarked are removed. */
+void gc_weak_tables()
+{
+	size_t i, j;
+	int changed;
+	do {
+		changed = 0;
+		for (i = 0; i < weak_size; i++) {
+			struct table *at = weak_tables[i];
+			if (at->weak != TABLE_WEAK_KEYS || !gc_marked(at)) continue;
+			for (j = 0; j < at->capacity; j++) {
+				struct table_entry *e;
+				for (e = at->data[j]; e; e = e->next) {
+					if (gc_live(e->k) && !gc_live(e->v)) {
+						gc_shade(e->v);
+						changed = 1;
+					}
+				}
+			}
+		}
+		gc_drain();
+	} while (changed);
+	for (i = 0; i < weak_size; i++) {
+		struct table *at = weak_tables[i];
+		if (!gc_marked(at)) continue; /* dead, its entries are freed by the sweep */
+		for (j = 0; j < at->capacity; j++) {
+			struct table_entry *e, **pe = &at->data[j];
+			while ((e = *pe) != NULL) {
+				if (gc_live(at->weak == TABLE_WEAK_KEYS ? e->k : e->v)) {
+					pe = &e->next;
+					continue;
+				}
+				*pe = e->next;
+				slab_free(e);
+				at->size--;
+				gc_account(at, (size_t)0 - sizeof(struct table_entry));
+			}
+		}
+	}
+	weak_size = 0;
+}
+
+/* The roots are the global atoms and the atoms of the root frames. */
+void gc_shade_roots()
+{
+	struct root_frame *f;
+	size_t i;
+	gc_shade(env);
+	gc_shade(err_expr);
+	gc_shade(thrown);
+	/* the names of the profiled functions, except top level */
+	for (i = 1; i < heap_site_count; i++) {
+		symbol_of(heap_sites[i].name)->mark = 1;
+	}
+	for (f = roots; f; f = f->prev) {
+		for (i = 0; i < ROOT_SLOTS; i++) {
+			if (f->atoms[i]) gc_shade(*f->atoms[i]);
+		}
+		if (f->vector) {
+			for (i = 0; i < f->vector->size; i++) {
+				gc_shade(f->vector->data[i]);
+			}
+		}
+	}
+}
+
+void gc_mark_roots()
+{
+	gc_shade_roots();
+	gc_drain();
+}
+
+/* Before a major collection marks. */
+void gc_clear_symbols()
+{
+	size_t i;
+	for (i = 0; i < symbol_capacity; i++) {
+		if (symbol_table[i]) symbol_table[i]->mark = symbol_table[i]->permanent;
+	}
+	for (i = 0; i < uniq_size; i++) {
+		uniq_symbols[i]->mark = 0;
+	}
+}
+
+void gc_sweep_uniq()
+{
+	size_t i, n = 0;
+	for (i = 0; i < uniq_size; i++) {
+		if (uniq_symbols[i]->mark) {
+			uniq_symbols[n++] = uniq_symbols[i];
+			continue;
+		}
+		heap_bytes -= sizeof(struct symbol) + UNIQ_NAME_SIZE;
+		free(uniq_symbols[i]);
+	}
+	uniq_size = n;
+}
+
+/* After a major collection marks, frees the symbols no atom refers to.
+ * The others are hashed again, into a smaller table if few are left. */
+void gc_sweep_symbols()
+{
+	size_t i, n = 0, capacity = symbol_capacity;
+	struct symbol **live;
+	gc_sweep_uniq();
+	live = malloc(symbol_size * sizeof(struct symbol *));
+	for (i = 0; i < symbol_capacity; i++) {
+		struct symbol *sym = symbol_table[i];
+		if (!sym) continue;
+		if (sym->mark) {
+			live[n++] = sym;
+			continue;
+		}
+		heap_bytes -= sizeof(struct symbol) + strlen(sym->name) + 1;
+		free(sym);
+	}
+	if (n == symbol_size) {
+		free(live);
+		return;
+	}
+	while (capacity > SYMBOL_MIN_CAPACITY && n * 8 < capacity) capacity /= 2;
+	symbol_rehash(live, n, capacity);
+	free(live);
+}
+
+/* Queues the slab to be swept on allocation. Its marked objects are the
+ * live ones, so the counts are right before the dead ones are freed. */
+void slab_sweep_later(struct slab *s)
+{
+	size_t w, words = (s->cls->count + 63) / 64, marked = 0;
+	for (w = 0; w < words; w++) {
+		marked += popcount64(s->mark[w]);
+	}
+	heap_bytes -= (s->live - marked) * s->cls->size;
+	s->live = marked;
+	s->dirty = 0;
+	s->unswept = 1;
+	if (!s->pending) { /* slabs swept from the avail list stay listed */
+		s->pending = 1;
+		s->next_pending = s->cls->pending;
+		s->cls->pending = s;
+	}
+}
+
+/* Frees the unmarked objects of the slab, 64 slots per bitmap word.
+ * Marked objects stay marked unless clear is set. */
+void slab_sweep(struct slab *s, int clear)
+{
+	struct slab_class *cls = s->cls;
+	size_t w, words = (cls->count + 63) / 64;
+	int freed = 0;
+	for (w = 0; w < words; w++) {
+		uint64_t dead = s->alloc[w] & ~s->mark[w];
+		if (!dead) continue;
+		s->alloc[w] &= s->mark[w];
+		freed = 1;
+		if (cls->finalize) {
+			while (dead) {
+				cls->finalize(slab_object(s, w * 64 + ctz64(dead)));
+				dead &= dead - 1;
+			}
+		}
+	}
+	if (clear) memset(s->mark, 0, words * sizeof(uint64_t));
+	s->unswept = 0;
+	if (freed) slab_rebuild_free(s);
+}
+
+/* Releases empty slabs and rebuilds the lists of slabs with free slots and
+ * of unswept slabs. */
+void slab_compact_class(struct slab_class *cls)
+{
+	struct slab *s, *next, **ps = &cls->slabs;
+	cls->avail = NULL;
+	cls->pending = NULL;
+	cls->swept = NULL;
+	for (s = cls->slabs; s; s = next) {
+		next = s->next;
+		if (s->live == 0) {
+			if (s->unswept) slab_sweep(s, 0); /* finalize the dead */
+			slab_release(s);
+			continue;
+		}
+		*ps = s;
+		ps = &s->next;
+		s->avail = s->free != NULL;
+		if (s->avail) {
+			s->next_avail = cls->avail;
+			cls->avail = s;
+		}
+		s->pending = s->unswept;
+		if (s->pending) {
+			s->next_pending = cls->pending;
+			cls->pending = s;
+		}
+	}
+	*ps = NULL;
+}
+
+/* Young objects are only in the slabs allocated from since the last
+ * collection, so only those need sweeping after a minor collection. */
+void gc_sweep_nursery()
+{
+	size_t i;
+	for (i = 0; i < SWEPT_CLASSES; i++) {
+		struct slab_class *cls = swept_classes[i];
+		struct slab *s;
+		for (s = cls->dirty; s; s = s->next_dirty) {
+			slab_sweep_later(s);
+		}
+		cls->dirty = NULL;
+	}
+	nursery_count = 0;
+}
+
+/* Collects the nursery only. The roots are the stack and the remembered old
+ * objects. */
+void gc_minor()
+{
+	size_t i;
+	gc_sweeper_pause();
+	gc_mark_roots();
+	for (i = 0; i < remembered_size; i++) {
+		gc_scan(remembered[i]);
+	}
+	remembered_size = 0;
+	gc_drain();
+	gc_weak_tables();
+	gc_account_garbage();
+	gc_sweep_nursery();
+	gc_sweeper_resume();
+}
+
+void gc_begin_cycle()
+{
+	size_t i;
+	struct slab *s;
+	/* the slots bound the objects and table entries to mark, and are
+	 * swept again */
+	gc_work_left = 0;
+	for (i = 0; i < SWEPT_CLASSES; i++) {
+		for (s = swept_classes[i]->slabs; s; s = s->next) gc_work_left += 2 * swept_classes[i]->count;
+	}
+	for (s = entry_class.slabs; s; s = s->next) gc_work_left += entry_class.count;
+	gc_phase = GC_MARKING;
+	marked_payload = 0;
+	gc_clear_symbols();
+	gc_shade_roots();
+}
+
+/* The roots are not covered by the write barrier, so they are scanned again
+ * and the remaining gray objects are traced without a budget. */
+void gc_finish_marking()
+{
+	size_t i;
+	gc_mark_roots();
+	gc_weak_tables();
+	gc_account_garbage();
+	if (heap_profile) heap_profile_dump();
+	gc_sweep_symbols();
+	gc_work_left = 0;
+	for (i = 0; i < SWEPT_CLASSES; i++) {
+		struct slab *s;
+		for (s = swept_classes[i]->slabs; s; s = s->next) {
+			slab_sweep_later(s);
+			gc_work_left += swept_classes[i]->count;
+		}
+		swept_classes[i]->dirty = NULL;
+	}
+	gc_set_threshold();
+	gc_phase = GC_SWEEPING;
+	sweep_class = 0;
+}
+
+/* Sweeps the slabs not swept by allocation yet, until the budget is used
+ * up. Returns the amount of work done. */
+size_t gc_sweep_slice(long start)
+{
+	size_t i, work = 0;
+	while (sweep_class < SWEPT_CLASSES) {
+		struct slab_class *cls = swept_classes[sweep_class];
+		struct slab *s = cls->pending;
+		if (!s) {
+			sweep_class++;
+			continue;
+		}
+		if (work >= gc_budget || (gc_pause > 0 && gc_now() - start >= gc_pause)) return work;
+		cls->pending = s->next_pending;
+		s->pending = 0;
+		if (s->unswept) {
+			slab_sweep(s, 1);
+			if (s->free) slab_make_avail(s);
+			work += cls->count;
+		}
+	}
+	for (i = 0; i < SWEPT_CLASSES; i++) {
+		slab_compact_class(swept_classes[i]);
+	}
+	slab_compact_class(&entry_class);
+	gc_phase = GC_IDLE;
+	return work;
+}
+
+/* Does one slice of the incremental collection. Returns the amount of work
+ * done. */
+size_t gc_step()
+{
+	long start = gc_pause > 0 ? gc_now() : 0;
+	size_t work = 0;
+	if (gc_phase == GC_MARKING) {
+		while (gray_size && !gc_slice_over(work, start)) {
+			work += gc_scan(gray[--gray_size]);
+		}
+		if (!gray_size) gc_finish_marking();
+	}
+	else if (gc_phase == GC_SWEEPING) {
+		work = gc_sweep_slice(start);
+	}
+	return work;
+}
+
+int slab_compare(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)*(struct slab **)a, y = (uintptr_t)*(struct slab **)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Pins the pair slabs that a word of the C stack or of a register points
+ * into, since C locals cannot be updated when their pairs move. */
+gc_no_sanitize void gc_pin_stack(struct slab **slabs, size_t n)
+{
+	jmp_buf regs; /* spills the registers to the stack */
+	void **p, **lo, **hi;
+	setjmp(regs);
+	lo = (void **)&regs;
+	hi = (void **)gc_stack_bottom;
+	if (lo > hi) {
+		p = lo;
+		lo = hi;
+		hi = p;
+	}
+	for (p = lo; p < hi; p++) {
+#ifdef NANBOX
+		struct slab *s = slab_of((uintptr_t)*p & NANBOX_PAYLOAD); /* or an atom */
+#else
+		struct slab *s = slab_of(*p);
+#endif
+		if (bsearch(&s, slabs, n, sizeof(*slabs), slab_compare)) s->pinned = 1;
+	}
+}
+
+struct pair *copy_alloc()
+{
+	struct slab *s;
+	if (!copy_slab_count || copy_index == pair_class.count) {
+		s = slab_new(&pair_class);
+		s->pinned = 1; /* copied pairs stay */
+		copy_slab_count++;
+		if (copy_slab_count > copy_slab_capacity) {
+			copy_slab_capacity = copy_slab_count * 2;
+			copy_slabs = realloc(copy_slabs, copy_slab_capacity * sizeof(struct slab *));
+		}
+		copy_slabs[copy_slab_count - 1] = s;
+		copy_index = 0;
+	}
+	s = copy_slabs[copy_slab_count - 1];
+	bit_set(s->alloc, copy_index);
+	bit_set(s->mark, copy_index);
+	return (struct pair *)slab_object(s, copy_index++);
+}
+
+/* Moves the pair of the atom unless its slab is pinned, and the rest of
+ * its list after it, so that the list is contiguous in cdr order. A moved
+ * pair is no longer allocated in its old slot and its car holds the new
+ * address. */
+void gc_forward(atom *ref)
+{
+	while (atom_type(*ref) == T_CONS || atom_type(*ref) == T_CLOSURE || atom_type(*ref) == T_MACRO) {
+		struct pair *p = atom_pair(*ref), *q;
+		struct slab *s = slab_of(p);
+		size_t i;
+		if (s->pinned) return;
+		i = slab_index(s, p);
+		if (!bit_test(s->alloc, i)) { /* already moved */
+			*ref = atom_of(atom_type(*ref), pair, atom_pair(p->car));
+			return;
+		}
+		q = copy_alloc();
+		*q = *p;
+		if (s->sites) {
+			struct slab *t = slab_of(q);
+			t->sites[slab_index(t, q)] = s->sites[i];
+		}
+		bit_clear(s->alloc, i);
+		p->car = atom_of(T_CONS, pair, q);
+		*ref = atom_of(atom_type(*ref), pair, q);
+		ref = &q->cdr;
+	}
+}
+
+/* Moves the live pairs out of the unpinned slabs, Cheney style, and
+ * releases those slabs. Runs after marking. */
+void gc_compact_pairs()
+{
+	struct slab *s, *old = pair_class.slabs, **slabs;
+	struct root_frame *f;
+	size_t i, j, n = 0, scan_slab, scan_index;
+
+	for (s = old; s; s = s->next) n++;
+	slabs = malloc(n * sizeof(struct slab *));
+	n = 0;
+	for (s = old; s; s = s->next) slabs[n++] = s;
+	qsort(slabs, n, sizeof(struct slab *), slab_compare);
+	gc_pin_stack(slabs, n);
+	free(slabs);
+	copy_slab_count = 0;
+
+	gc_forward(&env);
+	gc_forward(&err_expr);
+	gc_forward(&thrown);
+	for (f = roots; f; f = f->prev) {
+		for (i = 0; i < ROOT_SLOTS; i++) {
+			if (f->atoms[i]) gc_forward(f->atoms[i]);
+		}
+		if (f->vector) {
+			for (i = 0; i < f->vector->size; i++) {
+				gc_forward(&f->vector->data[i]);
+			}
+		}
+	}
+	for (s = table_class.slabs; s; s = s->next) {
+		for (i = 0; i < table_class.count; i++) {
+			struct table *at = (struct table *)slab_object(s, i);
+			if (!bit_test(s->mark, i)) continue;
+			for (j = 0; j < at->capacity; j++) {
+				struct table_entry *e;
+				for (e = at->data[j]; e; e = e->next) {
+					gc_forward(&e->k);
+					gc_forward(&e->v);
+				}
+			}
+		}
+	}
+	for (s = old; s; s = s->next) {
+		if (!s->pinned) continue;
+		for (i = 0; i < pair_class.count; i++) {
+			struct pair *p = (struct pair *)slab_object(s, i);
+			if (!bit_test(s->mark, i)) continue;
+			gc_forward(&p->car);
+			gc_forward(&p->cdr);
+		}
+	}
+	/* the copied pairs are scanned in the order they were copied */
+	for (scan_slab = 0; scan_slab < copy_slab_count; scan_slab++) {
+		for (scan_index = 0; ; scan_index++) {
+			struct pair *p;
+			if (scan_slab == copy_slab_count - 1 ? scan_index >= copy_index : scan_index == pair_class.count) break;
+			p = (struct pair *)slab_object(copy_slabs[scan_slab], scan_index);
+			gc_forward(&p->car);
+			gc_forward(&p->cdr);
+		}
+	}
+
+	for (i = 0; i < copy_slab_count; i++) {
+		s = copy_slabs[i];
+		s->live = i == copy_slab_count - 1 ? copy_index : pair_class.count;
+		slab_rebuild_free(s);
+		s->pinned = 0;
+	}
+	for (s = old; s; s = s->next) {
+		if (s->pinned) {
+			s->pinned = 0;
+		}
+		else { /* everything live has moved */
+			s->live = 0;
+			s->unswept = 0;
+		}
+	}
+	slab_compact_class(&pair_class);
+}
+
+/* Frees gray stacks grown by a deep structure, which would otherwise
+ * keep their peak size, and returns the freed pages to the OS. */
+void gc_trim_gray()
+{
+	int trimmed = 0;
+#ifdef GC_PARALLEL
+	size_t i;
+	for (i = 0; gc_workers && i < gc_threads; i++) {
+		if (gc_workers[i].gray_capacity > GC_GRAY_KEEP) {
+			free(gc_workers[i].gray);
+			gc_workers[i].gray = NULL;
+			gc_workers[i].gray_capacity = 0;
+			trimmed = 1;
+		}
+	}
+#endif
+	if (gray_capacity > GC_GRAY_KEEP) {
+		free(gray);
+		gray = NULL;
+		gray_capacity = 0;
+		trimmed = 1;
+	}
+#ifdef __GLIBC__
+	if (trimmed) malloc_trim(0);
+#endif
+	(void)trimmed;
+}
+
+/* Returns the site of a function name, adding it if it is new. Names are
+ * symbol names, so they are hashed by address. */
+uint32_t heap_site_of(char *name)
+{
+	size_t i, mask;
+	if (heap_site_count * 2 >= heap_site_index_capacity) {
+		size_t j, capacity = heap_site_index_capacity ? heap_site_index_capacity * 2 : 256;
+		free(heap_site_index);
+		heap_site_index = calloc(capacity, sizeof(uint32_t));
+		heap_site_index_capacity = capacity;
+		for (j = 0; j < heap_site_count; j++) {
+			i = ((uintptr_t)heap_sites[j].name >> 3) & (capacity - 1);
+			while (heap_site_index[i]) i = (i + 1) & (capacity - 1);
+			heap_site_index[i] = (uint32_t)j + 1;
+		}
+	}
+	mask = heap_site_index_capacity - 1;
+	for (i = ((uintptr_t)name >> 3) & mask; heap_site_index[i]; i = (i + 1) & mask) {
+		if (heap_sites[heap_site_index[i] - 1].name == name) return heap_site_index[i] - 1;
+	}
+	heap_site_count++;
+	if (heap_site_count > heap_site_capacity) {
+		heap_site_capacity = heap_site_count * 2;
+		heap_sites = realloc(heap_sites, heap_site_capacity * sizeof(struct heap_site));
+	}
+	memset(&heap_sites[heap_site_count - 1], 0, sizeof(struct heap_site));
+	heap_sites[heap_site_count - 1].name = name;
+	heap_site_index[i] = (uint32_t)heap_site_count;
+	return (uint32_t)heap_site_count - 1;
+}
+
+/* Called when a closure is entered. Its allocations are attributed to the
+ * global name it is called by, or else to its caller, so anonymous
+ * functions count towards the named function that runs them. */
+void heap_profile_enter(atom op, atom fn)
+{
+	struct table_entry *e;
+	if (atom_type(op) != T_SYM) return;
+	e = table_get_sym(atom_table(cdr(env)), atom_symbol(op));
+	if (e && atom_type(e->v) == T_CLOSURE && atom_pair(e->v) == atom_pair(fn)) heap_site = heap_site_of(atom_symbol(op));
+}
+
+int heap_row_compare(const void *a, const void *b)
+{
+	const size_t *x = a, *y = b;
+	size_t bx = heap_sites[x[0]].bytes[x[1]], by = heap_sites[y[0]].bytes[y[1]];
+	return bx < by ? 1 : bx > by ? -1 : 0;
+}
+
+/* Writes the live objects by site and class to the profile file, largest
+ * first. Runs after marking, when the marked objects are the live ones. */
+void heap_profile_dump()
+{
+	static const char *class_names[] = { "pair", "string", "table", "port", "bignum" };
+	size_t i, k, rows = 0, (*row)[2], total = 0;
+	struct slab *s;
+	FILE *fp;
+	for (k = 0; k < SWEPT_CLASSES; k++) {
+		for (s = swept_classes[k]->slabs; s; s = s->next) {
+			if (!s->sites) continue;
+			for (i = 0; i < swept_classes[k]->count; i++) {
+				struct heap_site *site;
+				void *obj;
+				size_t bytes = swept_classes[k]->size;
+				if (!bit_test(s->mark, i)) continue;
+				obj = slab_object(s, i);
+				if (swept_classes[k] == &str_class) bytes += ((struct str *)obj)->capacity;
+				else if (swept_classes[k] == &table_class) bytes += table_payload(obj);
+				else if (swept_classes[k] == &bignum_class) bytes += ((struct bignum *)obj)->size * sizeof(uint32_t);
+				site = &heap_sites[s->sites[i]];
+				site->count[k]++;
+				site->bytes[k] += bytes;
+				total += bytes;
+			}
+		}
+	}
+	row = malloc(heap_site_count * SWEPT_CLASSES * sizeof(*row));
+	for (i = 0; i < heap_site_count; i++) {
+		for (k = 0; k < SWEPT_CLASSES; k++) {
+			if (!heap_sites[i].count[k]) continue;
+			row[rows][0] = i;
+			row[rows][1] = k;
+			rows++;
+		}
+	}
+	qsort(row, rows, sizeof(*row), heap_row_compare);
+	heap_profile_number++;
+	fp = fopen(heap_profile, "w");
+	if (fp) {
+		fprintf(fp, "heap profile after collection %zu: %zu live bytes\n", heap_profile_number, total);
+		fprintf(fp, "%14s %10s %-7s %s\n", "bytes", "count", "type", "site");
+		for (i = 0; i < rows; i++) {
+			struct heap_site *site = &heap_sites[row[i][0]];
+			k = row[i][1];
+			fprintf(fp, "%14zu %10zu %-7s %s\n", site->bytes[k], site->count[k], class_names[k], row[i][0] ? symbol_name(site->name) : site->name);
+		}
+		fclose(fp);
+	}
+	free(row);
+	for (i = 0; i < heap_site_count; i++) {
+		memset(heap_sites[i].count, 0, sizeof(heap_sites[i].count));
+		memset(heap_sites[i].bytes, 0, sizeof(heap_sites[i].bytes));
+	}
+}
+
+/* Returns the id of a heap object plus one, numbering it if it is new, or
+ * 0 for other atoms. */
+size_t heap_dump_id(struct heap_dump *d, atom a)
+{
+	void *p = heap_object(a);
+	size_t i, mask;
+	if (!p) return 0;
+	if (d->count * 2 >= d->key_capacity) {
+		size_t j, capacity = d->key_capacity ? d->key_capacity * 2 : 1024;
+		free(d->keys);
+		free(d->ids);
+		d->keys = calloc(capacity, sizeof(void *));
+		d->ids = malloc(capacity * sizeof(uint32_t));
+		d->key_capacity = capacity;
+		for (j = 0; j < d->count; j++) {
+			void *q = heap_object(d->objects[j]);
+			i = ((uintptr_t)q >> 4) & (capacity - 1);
+			while (d->keys[i]) i = (i + 1) & (capacity - 1);
+			d->keys[i] = q;
+			d->ids[i] = (uint32_t)j;
+		}
+	}
+	mask = d->key_capacity - 1;
+	for (i = ((uintptr_t)p >> 4) & mask; d->keys[i]; i = (i + 1) & mask) {
+		if (d->keys[i] == p) return d->ids[i] + 1;
+	}
+	d->keys[i] = p;
+	d->ids[i] = (uint32_t)d->count;
+	d->count++;
+	if (d->count > d->capacity) {
+		d->capacity = d->count * 2;
+		d->objects = realloc(d->objects, d->capacity * sizeof(atom));
+	}
+	d->objects[d->count - 1] = a;
+	return d->count;
+}
+
+void heap_dump_varint(FILE *fp, size_t n)
+{
+	while (n >= 0x80) {
+		putc((int)(n & 0x7f) | 0x80, fp);
+		n >>= 7;
+	}
+	putc((int)n, fp);
+}
+
+void heap_dump_root(struct heap_dump *d, const char *name, atom a)
+{
+	size_t id = heap_dump_id(d, a);
+	if (!id) return;
+	d->root_count++;
+	if (d->root_count > d->root_capacity) {
+		d->root_capacity = d->root_count * 2;
+		d->root_names = realloc(d->root_names, d->root_capacity * sizeof(char *));
+		d->root_ids = realloc(d->root_ids, d->root_capacity * sizeof(size_t));
+	}
+	d->root_names[d->root_count - 1] = name;
+	d->root_ids[d->root_count - 1] = id - 1;
+}
+
+/* Writes the objects reachable from the global variables and the atoms
+ * held by the interpreter to a file. The file is "ARCHEAP1", the number
+ * of roots, each root as name length, name and object id, the number of
+ * objects, and each object as type, bytes, number of edges and the ids
+ * they point to. Numbers are LEB128 varints and types are enum type.
+ * Ids number the objects in file order. Returns 0 if the file cannot be
+ * written. */
+int heap_dump(const char *path)
+{
+	struct heap_dump d;
+	struct table *globals = atom_table(cdr(env));
+	struct root_frame *f;
+	size_t i, j;
+	FILE *fp = fopen(path, "wb");
+	if (!fp) return 0;
+	memset(&d, 0, sizeof(d));
+	for (i = 0; i < globals->capacity; i++) {
+		struct table_entry *e;
+		for (e = globals->data[i]; e; e = e->next) {
+			heap_dump_root(&d, symbol_name(atom_symbol(e->k)), e->v);
+		}
+	}
+	heap_dump_root(&d, "(error)", err_expr);
+	heap_dump_root(&d, "(thrown)", thrown);
+	for (f = roots; f; f = f->prev) {
+		for (i = 0; i < ROOT_SLOTS; i++) {
+			if (f->atoms[i]) heap_dump_root(&d, "(stack)", *f->atoms[i]);
+		}
+		for (i = 0; f->vector && i < f->vector->size; i++) {
+			heap_dump_root(&d, "(stack)", f->vector->data[i]);
+		}
+	}
+	/* number everything reachable, breadth first */
+	for (i = 0; i < d.count; i++) {
+		atom a = d.objects[i];
+		if (atom_type(a) == T_TABLE) {
+			struct table *at = atom_table(a);
+			for (j = 0; j < at->capacity; j++) {
+				struct table_entry *e;
+				for (e = at->data[j]; e; e = e->next) {
+					heap_dump_id(&d, e->k);
+					heap_dump_id(&d, e->v);
+				}
+			}
+		}
+		else if (atom_type(a) == T_STRING) {
+			if (str_slice(atom_str(a))) heap_dump_id(&d, atom_of(T_STRING, str, atom_str(a)->parent));
+		}
+		else if (atom_type(a) != T_BIGNUM && !is_port(a)) {
+			heap_dump_id(&d, car(a));
+			heap_dump_id(&d, cdr(a));
+		}
+	}
+
+	fputs("ARCHEAP1", fp);
+	heap_dump_varint(fp, d.root_count);
+	for (i = 0; i < d.root_count; i++) {
+		heap_dump_varint(fp, strlen(d.root_names[i]));
+		fputs(d.root_names[i], fp);
+		heap_dump_varint(fp, d.root_ids[i]);
+	}
+	heap_dump_varint(fp, d.count);
+	for (i = 0; i < d.count; i++) {
+		atom a = d.objects[i];
+		size_t n = 0, id;
+		putc(atom_type(a), fp);
+		if (atom_type(a) == T_STRING) {
+			heap_dump_varint(fp, str_class.size + atom_str(a)->capacity);
+			if (str_slice(atom_str(a))) {
+				heap_dump_varint(fp, 1);
+				heap_dump_varint(fp, heap_dump_id(&d, atom_of(T_STRING, str, atom_str(a)->parent)) - 1);
+			}
+			else heap_dump_varint(fp, 0);
+		}
+		else if (is_port(a)) {
+			heap_dump_varint(fp, port_class.size);
+			heap_dump_varint(fp, 0);
+		}
+		else if (atom_type(a) == T_BIGNUM) {
+			heap_dump_varint(fp, bignum_class.size + atom_bignum(a)->size * sizeof(uint32_t));
+			heap_dump_varint(fp, 0);
+		}
+		else if (atom_type(a) == T_TABLE) {
+			struct table *at = atom_table(a);
+			struct table_entry *e;
+			heap_dump_varint(fp, table_class.size + table_payload(at));
+			for (j = 0; j < at->capacity; j++) {
+				for (e = at->data[j]; e; e = e->next) {
+					n += heap_object(e->k) != NULL;
+					n += heap_object(e->v) != NULL;
+				}
+			}
+			heap_dump_varint(fp, n);
+			for (j = 0; j < at->capacity; j++) {
+				for (e = at->data[j]; e; e = e->next) {
+					if ((id = heap_dump_id(&d, e->k)) != 0) heap_dump_varint(fp, id - 1);
+					if ((id = heap_dump_id(&d, e->v)) != 0) heap_dump_varint(fp, id - 1);
+				}
+			}
+		}
+		else {
+			size_t car_id = heap_dump_id(&d, car(a)), cdr_id = heap_dump_id(&d, cdr(a));
+			heap_dump_varint(fp, pair_class.size);
+			heap_dump_varint(fp, (car_id != 0) + (cdr_id != 0));
+			if (car_id) heap_dump_varint(fp, car_id - 1);
+			if (cdr_id) heap_dump_varint(fp, cdr_id - 1);
+		}
+	}
+	free(d.objects);
+	free(d.keys);
+	free(d.ids);
+	free(d.root_names);
+	free(d.root_ids);
+	return fclose(fp) == 0;
+}
+
+void heap_dump_signal(int sig)
+{
+	(void)sig;
+	heap_dump_requested = 1;
+}
+
+/* A dump requested by SIGUSR1 is written at the next evaluation step,
+ * where the heap is consistent. */
+void heap_dump_on_request()
+{
+#ifdef SIGUSR1
+	char path[64];
+	heap_dump_requested = 0;
+	sprintf(path, "arcadia-%ld.heap", (long)getpid());
+	if (heap_dump(path))
+		fprintf(stderr, "Heap dumped to %s\n", path);
+	else
+		fprintf(stderr, "Cannot write %s\n", path);
+#endif
+}
+
+/* Collects both generations. The incremental collector finishes the
+ * current cycle without a budget instead. */
+void gc()
+{
+	size_t i;
+	struct slab *s;
+
+	if (gc_incremental) {
+		size_t budget = gc_budget;
+		long pause = gc_pause;
+		if (gc_phase == GC_IDLE) gc_begin_cycle();
+		gc_budget = (size_t)-1;
+		gc_pause = 0;
+		while (gc_phase != GC_IDLE) gc_step();
+		gc_budget = budget;
+		gc_pause = pause;
+		return;
+	}
+
+	gc_sweeper_pause();
+	/* old objects are marked between collections */
+	for (i = 0; i < SWEPT_CLASSES; i++) {
+		struct slab_class *cls = swept_classes[i];
+		for (s = cls->slabs; s; s = s->next) {
+			memset(s->mark, 0, sizeof(s->mark));
+			memset(s->remembered, 0, sizeof(s->remembered));
+		}
+	}
+	remembered_size = 0;
+	marked_payload = 0;
+	gc_clear_symbols();
+
+#ifdef GC_PARALLEL
+	if (gc_threads > 1) {
+		gc_shade_roots();
+		gc_drain_parallel();
+	}
+	else
+#endif
+	gc_mark_roots();
+	gc_weak_tables();
+	gc_account_garbage();
+	if (heap_profile) heap_profile_dump();
+	gc_sweep_symbols();
+
+	/* The dead objects are freed when allocation reaches their slabs.
+	 * Only the slabs with no live object are swept and released now. */
+	for (i = 0; i < SWEPT_CLASSES; i++) {
+		struct slab_class *cls = swept_classes[i];
+		for (s = cls->slabs; s; s = s->next) {
+			slab_sweep_later(s);
+		}
+		cls->dirty = NULL;
+		slab_compact_class(cls);
+	}
+	if (gc_compacting && gc_stack_bottom) gc_compact_pairs();
+	/* the swept tables have returned their entries */
+	slab_compact_class(&entry_class);
+	gc_trim_gray();
+	nursery_count = 0;
+	gc_set_threshold();
+	gc_sweeper_resume();
+}
+
+/* Sweeps the slabs left by the last collection and releases the empty
+ * ones. */
+void gc_sweep_all()
+{
+	size_t i;
+	gc_sweeper_pause();
+	for (i = 0; i < SWEPT_CLASSES; i++) {
+		struct slab_class *cls = swept_classes[i];
+		struct slab *s;
+		while ((s = cls->pending) != NULL) {
+			cls->pending = s->next_pending;
+			s->pending = 0;
+			if (s->unswept) slab_sweep(s, gc_incremental);
+		}
+		slab_compact_class(cls);
+	}
+	slab_compact_class(&entry_class);
+	gc_sweeper_resume();
+}
+
+/* Returns 0 if the heap cannot grow by bytes without passing --max-heap,
+ * even after a full collection. */
+int gc_reserve(size_t bytes)
+{
+	if (heap_bytes <= heap_limit && bytes <= heap_limit - heap_bytes) return 1;
+	gc();
+	gc_sweep_all();
+	if (heap_bytes <= gc_max_heap && bytes <= gc_max_heap - heap_bytes) {
+		heap_limit = gc_max_heap;
+		return 1;
+	}
+	heap_limit = gc_max_heap + gc_max_heap / 8;
+	return 0;
+}
+
+
+atom make_number(double x)
+{
+#ifdef NANBOX
+	atom a;
+	if (x != x) x = NAN; /* a negative NaN would read as a tagged atom */
+	memcpy(&a, &x, sizeof(a));
+	return a;
+#else
+	atom a;
+	a.type = T_NUM;
+	a.value.number = x;
+	return a;
+#endif
+}
+
+/* Returns a fixnum, or a bignum if x is out of the fixnum range. */
+atom make_fixnum(int64_t x)
+{
+#ifdef NANBOX
+	if (x < FIXNUM_MIN || x > FIXNUM_MAX) {
+		uint32_t *digit = malloc(2 * sizeof(uint32_t));
+		uint64_t u = x < 0 ? 0 - (uint64_t)x : (uint64_t)x;
+		digit[0] = (uint32_t)u;
+		digit[1] = (uint32_t)(u >> 32);
+		return make_bignum(x < 0 ? -1 : 1, digit, 2);
+	}
+	return NANBOX_TAGGED | nanbox_tag(T_FIXNUM) | ((uint64_t)x & NANBOX_PAYLOAD);
+#else
+	return atom_of(T_FIXNUM, fixnum, x);
+#endif
+}
+
+/* Fixnum arithmetic. Each returns 0 if the result is not a fixnum. */
+int fixnum_add(int64_t a, int64_t b, int64_t *r)
+{
+#ifdef __GNUC__
+	if (__builtin_add_overflow(a, b, r)) return 0;
+#else
+	if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)) return 0;
+	*r = a + b;
+#endif
+	return *r >= FIXNUM_MIN && *r <= FIXNUM_MAX;
+}
+
+int fixnum_sub(int64_t a, int64_t b, int64_t *r)
+{
+#ifdef __GNUC__
+	if (__builtin_sub_overflow(a, b, r)) return 0;
+#else
+	if ((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b)) return 0;
+	*r = a - b;
+#endif
+	return *r >= FIXNUM_MIN && *r <= FIXNUM_MAX;
+}
+
+int fixnum_mul(int64_t a, int64_t b, int64_t *r)
+{
+#ifdef __GNUC__
+	if (__builtin_mul_overflow(a, b, r)) return 0;
+#else
+	if (fabs((double)a * (double)b) >= 9.2e18) return 0; /* below 2^63 by more than the rounding */
+	*r = a * b;
+#endif
+	return *r >= FIXNUM_MIN && *r <= FIXNUM_MAX;
+}
+
+/* Bignum magnitudes are arrays of base 2^32 digits, least significant
+ * first. The functions below return the size of their result without
+ * leading zeros. */
+
+size_t big_trim(const uint32_t *a, size_t n)
+{
+	while (n > 0 && a[n - 1] == 0) n--;
+	return n;
+}
+
+int big_cmp(const uint32_t *a, size_t an, const uint32_t *b, size_t bn)
+{
+	if (an != bn) return an < bn ? -1 : 1;
+	while (an-- > 0) {
+		if (a[an] != b[an]) return a[an] < b[an] ? -1 : 1;
+	}
+	return 0;
+}
+
+/* r = a + b. r has room for max(an, bn) + 1 digits and may be a or b. */
+size_t big_add(const uint32_t *a, size_t an, const uint32_t *b, size_t bn, uint32_t *r)
+{
+	uint64_t carry = 0;
+	size_t i;
+	if (an < bn) {
+		const uint32_t *t = a;
+		a = b;
+		b = t;
+		i = an;
+		an = bn;
+		bn = i;
+	}
+	for (i = 0; i < bn; i++) {
+		carry += (uint64_t)a[i] + b[i];
+		r[i] = (uint32_t)carry;
+		carry >>= 32;
+	}
+	for (; i < an; i++) {
+		carry += a[i];
+		r[i] = (uint32_t)carry;
+		carry >>= 32;
+	}
+	r[an] = (uint32_t)carry;
+	return big_trim(r, an + 1);
+}
+
+/* r = a - b for a >= b. r has room for an digits and may be a or b. */
+size_t big_sub(const uint32_t *a, size_t an, const uint32_t *b, size_t bn, uint32_t *r)
+{
+	uint64_t borrow = 0;
+	size_t i;
+	for (i = 0; i < an; i++) {
+		uint64_t t = (uint64_t)a[i] - (i < bn ? b[i] : 0) - borrow;
+		r[i] = (uint32_t)t;
+		borrow = t >> 63;
+	}
+	return big_trim(r, an);
+}
+
+/* Adds a to the n digits at r, which have room for the carry. */
+void big_add_into(uint32_t *r, size_t n, const uint32_t *a, size_t an)
+{
+	uint64_t carry = 0;
+	size_t i;
+	for (i = 0; i < an; i++) {
+		carry += (uint64_t)r[i] + a[i];
+		r[i] = (uint32_t)carry;
+		carry >>= 32;
+	}
+	for (; carry && i < n; i++) {
+		carry += r[i];
+		r[i] = (uint32_t)carry;
+		carry >>= 32;
+	}
+}
+
+/* r = a * b, writing all an + bn digits of r, which does not overlap a or
+ * b. Karatsuba from KARATSUBA_THRESHOLD digits, schoolbook below. */
+void big_mul(const uint32_t *a, size_t an, const uint32_t *b, size_t bn, uint32_t *r)
+{
+	size_t i, j, h;
+	if (an < bn) {
+		const uint32_t *t = a;
+		a = b;
+		b = t;
+		i = an;
+		an = bn;
+		bn = i;
+	}
+	if (bn < KARATSUBA_THRESHOLD) {
+		memset(r, 0, (an + bn) * sizeof(uint32_t));
+		for (j = 0; j < bn; j++) {
+			uint64_t carry = 0;
+			if (b[j] == 0) continue;
+			for (i = 0; i < an; i++) {
+				carry += (uint64_t)a[i] * b[j] + r[i + j];
+				r[i + j] = (uint32_t)carry;
+				carry >>= 32;
+			}
+			r[an + j] = (uint32_t)carry;
+		}
+		return;
+	}
+	if (an >= 2 * bn) {
+		/* b times each piece of a of its size */
+		uint32_t *t = malloc(2 * bn * sizeof(uint32_t));
+		memset(r, 0, (an + bn) * sizeof(uint32_t));
+		for (i = 0; i < an; i += bn) {
+			size_t n = an - i < bn ? an - i : bn;
+			big_mul(a + i, n, b, bn, t);
+			big_add_into(r + i, an + bn - i, t, n + bn);
+		}
+		free(t);
+		return;
+	}
+	/* a = a1 B^h + a0 and b = b1 B^h + b0, so
+	 * a b = a1 b1 B^2h + ((a0 + a1)(b0 + b1) - a0 b0 - a1 b1) B^h + a0 b0 */
+	h = (an + 1) / 2;
+	{
+		uint32_t *s = malloc((4 * h + 4) * sizeof(uint32_t)), *t = s + h + 1, *m = t + h + 1;
+		size_t sn, tn, mn;
+		big_mul(a, h, b, h, r);
+		big_mul(a + h, an - h, b + h, bn - h, r + 2 * h);
+		sn = big_add(a, h, a + h, an - h, s);
+		tn = big_add(b, h, b + h, bn - h, t);
+		big_mul(s, sn, t, tn, m);
+		mn = big_trim(m, sn + tn);
+		mn = big_sub(m, mn, r, big_trim(r, 2 * h), m);
+		mn = big_sub(m, mn, r + 2 * h, big_trim(r + 2 * h, an + bn - 2 * h), m);
+		big_add_into(r + h, an + bn - h, m, mn);
+		free(s);
+	}
+}
+
+/* q = a / d, returning a % d. q has an digits and may be a. */
+uint32_t big_div_small(const uint32_t *a, size_t an, uint32_t d, uint32_t *q)
+{
+	uint64_t rem = 0;
+	while (an-- > 0) {
+		rem = rem << 32 | a[an];
+		q[an] = (uint32_t)(rem / d);
+		rem %= d;
+	}
+	return (uint32_t)rem;
+}
+
+/* q = a / b and r = a % b for an >= bn > 0, by Knuth's algorithm D.
+ * q has an - bn + 1 digits and r has bn. */
+void big_divmod(const uint32_t *a, size_t an, const uint32_t *b, size_t bn, uint32_t *q, uint32_t *r)
+{
+	uint32_t *u, *v;
+	size_t i, j;
+	int s = 0;
+	if (bn == 1) {
+		r[0] = big_div_small(a, an, b[0], q);
+		return;
+	}
+	/* shift so that the top bit of the divisor is set */
+	while (!((b[bn - 1] << s) & 0x80000000u)) s++;
+	u = malloc((an + 1 + bn) * sizeof(uint32_t));
+	v = u + an + 1;
+	for (i = bn - 1; i > 0; i--) v[i] = b[i] << s | (s ? b[i - 1] >> (32 - s) : 0);
+	v[0] = b[0] << s;
+	u[an] = s ? a[an - 1] >> (32 - s) : 0;
+	for (i = an - 1; i > 0; i--) u[i] = a[i] << s | (s ? a[i - 1] >> (32 - s) : 0);
+	u[0] = a[0] << s;
+	for (j = an - bn + 1; j-- > 0;) {
+		uint64_t num = (uint64_t)u[j + bn] << 32 | u[j + bn - 1];
+		uint64_t qhat = num / v[bn - 1], rhat = num % v[bn - 1];
+		int64_t t, k = 0;
+		while (qhat >> 32 || qhat * v[bn - 2] > (rhat << 32 | u[j + bn - 2])) {
+			qhat--;
+			rhat += v[bn - 1];
+			if (rhat >> 32) break;
+		}
+		for (i = 0; i < bn; i++) {
+			uint64_t p = qhat * v[i];
+			t = (int64_t)u[i + j] - k - (int64_t)(p & 0xffffffff);
+			u[i + j] = (uint32_t)t;
+			k = (int64_t)(p >> 32) - (t >> 32);
+		}
+		t = (int64_t)u[j + bn] - k;
+		u[j + bn] = (uint32_t)t;
+		q[j] = (uint32_t)qhat;
+		if (t < 0) { /* qhat was one too large */
+			uint64_t carry = 0;
+			q[j]--;
+			for (i = 0; i < bn; i++) {
+				carry += (uint64_t)u[i + j] + v[i];
+				u[i + j] = (uint32_t)carry;
+				carry >>= 32;
+			}
+			u[j + bn] += (uint32_t)carry;
+		}
+	}
+	for (i = 0; i < bn; i++) r[i] = u[i] >> s | (s ? u[i + 1] << (32 - s) : 0);
+	free(u);
+}
+
+/* The magnitude, rounded to the nearest double. */
+double big_double(const uint32_t *a, size_t n)
+{
+	uint64_t top;
+	size_t i;
+	int z = 0, sticky;
+	if (n <= 2) return (double)((n > 1 ? (uint64_t)a[1] << 32 : 0) | (n ? a[0] : 0));
+	/* The top 64 bits, with the lowest one set if any bit below them is,
+	 * round the same as the whole. */
+	while (!((a[n - 1] << z) & 0x80000000u)) z++;
+	top = ((uint64_t)a[n - 1] << 32 | a[n - 2]) << z;
+	if (z) top |= a[n - 3] >> (32 - z);
+	sticky = (uint32_t)(a[n - 3] << z) != 0;
+	for (i = 0; !sticky && i < n - 3; i++) sticky = a[i] != 0;
+	return ldexp((double)(top | (uint64_t)sticky), (int)(32 * (n - 2)) - z);
+}
+
+/* The magnitude of the integral double x, into 33 digits at r. */
+size_t big_from_double(double x, uint32_t *r)
+{
+	uint64_t m, hi;
+	int e, shift;
+	size_t i;
+	memset(r, 0, 33 * sizeof(uint32_t));
+	if (x == 0) return 0;
+	m = (uint64_t)ldexp(frexp(fabs(x), &e), 53);
+	shift = e - 53;
+	if (shift < 0) {
+		m >>= -shift;
+		shift = 0;
+	}
+	i = shift / 32;
+	shift %= 32;
+	r[i] = (uint32_t)(m << shift);
+	hi = shift ? m >> (32 - shift) : m >> 32;
+	r[i + 1] = (uint32_t)hi;
+	r[i + 2] = (uint32_t)(hi >> 32);
+	return big_trim(r, i + 3);
+}
+
+/* Sets the reciprocal of p = q^2 by Newton's iteration, starting from the
+ * square of the reciprocal of q. Every step stays at or below the
+ * reciprocal, so the error e is never negative. */
+void big_inverse(struct big_power *p, const struct big_power *q)
+{
+	size_t m = p->size, d = 4 * q->size - 2 * m, mun, en, tn;
+	uint32_t *mu = calloc(m + 2, sizeof(uint32_t)), *e = malloc((2 * m + 1) * sizeof(uint32_t));
+	uint32_t *t = malloc((3 * m + 3) * sizeof(uint32_t)), one = 1;
+	big_mul(q->inverse, q->inverse_size, q->inverse, q->inverse_size, t);
+	tn = big_trim(t, 2 * q->inverse_size);
+	mun = tn > d ? tn - d : 0;
+	memcpy(mu, t + d, mun * sizeof(uint32_t));
+	for (;;) {
+		/* e = B^2m - mu p */
+		big_mul(mu, mun, p->digit, m, t);
+		tn = big_trim(t, mun + m);
+		memset(e, 0, 2 * m * sizeof(uint32_t));
+		e[2 * m] = 1;
+		en = big_sub(e, 2 * m + 1, t, tn, e);
+		if (big_cmp(e, en, p->digit, m) < 0) break;
+		/* mu += mu e / B^2m, or 1 once that is below 1 */
+		big_mul(mu, mun, e, en, t);
+		tn = big_trim(t, mun + en);
+		if (tn > 2 * m) mun = big_add(mu, mun, t + 2 * m, tn - 2 * m, mu);
+		else mun = big_add(mu, mun, &one, 1, mu);
+	}
+	p->inverse = mu;
+	p->inverse_size = mun;
+	free(e);
+	free(t);
+}
+
+/* 10^(9 2^k), computed on first use */
+struct big_power *big_power(size_t k)
+{
+	while (big_power_count <= k) {
+		struct big_power *p;
+		big_powers = realloc(big_powers, (big_power_count + 1) * sizeof(struct big_power));
+		p = &big_powers[big_power_count];
+		if (big_power_count == 0) {
+			uint64_t inverse = UINT64_MAX / 1000000000;
+			p->digit = malloc(sizeof(uint32_t));
+			p->digit[0] = 1000000000;
+			p->size = 1;
+			p->inverse = malloc(2 * sizeof(uint32_t));
+			p->inverse[0] = (uint32_t)inverse;
+			p->inverse[1] = (uint32_t)(inverse >> 32);
+			p->inverse_size = 2;
+		}
+		else {
+			struct big_power *q = p - 1;
+			p->digit = malloc(2 * q->size * sizeof(uint32_t));
+			big_mul(q->digit, q->size, q->digit, q->size, p->digit);
+			p->size = big_trim(p->digit, 2 * q->size);
+			big_inverse(p, q);
+		}
+		big_power_count++;
+	}
+	return &big_powers[k];
+}
+
+/* q = x / p and r = x % p for x < B^2m, where p has m digits, by Barrett
+ * reduction with the reciprocal of p. q has room for m + 2 digits and r
+ * for xn. */
+void big_barrett(const uint32_t *x, size_t xn, const struct big_power *p, uint32_t *q, size_t *qn, uint32_t *r, size_t *rn)
+{
+	size_t m = p->size, n;
+	uint32_t *t, one = 1;
+	if (big_cmp(x, xn, p->digit, m) < 0) {
+		*qn = 0;
+		memcpy(r, x, xn * sizeof(uint32_t));
+		*rn = xn;
+		return;
+	}
+	t = malloc((2 * m + 2) * sizeof(uint32_t));
+	/* q is at most 2 below x / B^(m - 1) * inverse / B^(m + 1) */
+	big_mul(x + m - 1, xn - (m - 1), p->inverse, p->inverse_size, t);
+	n = big_trim(t, xn - (m - 1) + p->inverse_size);
+	*qn = n > m + 1 ? n - (m + 1) : 0;
+	memcpy(q, t + m + 1, *qn * sizeof(uint32_t));
+	big_mul(q, *qn, p->digit, m, t);
+	n = big_trim(t, *qn + m);
+	*rn = big_sub(x, xn, t, n, r);
+	while (big_cmp(r, *rn, p->digit, m) >= 0) {
+		*rn = big_sub(r, *rn, p->digit, m, r);
+		*qn = big_add(q, *qn, &one, 1, q);
+	}
+	free(t);
+}
+
+/* Writes the magnitude as width decimal digits with leading zeros. Large
+ * numbers are split in halves by the powers 10^(9 2^k), so the cost is
+ * that of the multiplications. */
+void big_to_decimal(const uint32_t *x, size_t xn, char *out, size_t width)
+{
+	struct big_power *p;
+	uint32_t *q, *r;
+	size_t k = 0, low, qn, rn;
+	if (xn < BIG_CONVERT_THRESHOLD) {
+		uint32_t *t = malloc((xn + 1) * sizeof(uint32_t));
+		char *end = out + width;
+		memcpy(t, x, xn * sizeof(uint32_t));
+		while (xn > 0) {
+			uint32_t d = big_div_small(t, xn, 1000000000, t);
+			int i;
+			xn = big_trim(t, xn);
+			for (i = 0; i < 9 && end > out; i++) {
+				*--end = '0' + d % 10;
+				d /= 10;
+			}
+		}
+		memset(out, '0', end - out);
+		free(t);
+		return;
+	}
+	/* the low digits are the largest 9 2^k below width, so x / p < p */
+	while (9 * ((size_t)2 << k) < width) k++;
+	low = 9 * ((size_t)1 << k);
+	p = big_power(k);
+	q = malloc((p->size + 2 + xn) * sizeof(uint32_t));
+	r = q + p->size + 2;
+	big_barrett(x, xn, p, q, &qn, r, &rn);
+	big_to_decimal(q, qn, out, width - low);
+	big_to_decimal(r, rn, out + width - low, low);
+	free(q);
+}
+
+/* Parses n decimal digits into r, which has room for n / 9 + 2 digits. */
+size_t big_from_decimal(const char *s, size_t n, uint32_t *r)
+{
+	struct big_power *p;
+	uint32_t *hi, *t;
+	size_t k = 0, low, hn, tn, rn = 0;
+	if (n <= 9 * BIG_CONVERT_THRESHOLD) {
+		const char *end = s + n;
+		size_t i = n % 9 ? n % 9 : 9;
+		while (s < end) {
+			uint32_t chunk = 0, scale = 1;
+			uint64_t carry;
+			size_t j;
+			for (; i > 0; i--, s++) {
+				chunk = chunk * 10 + (*s - '0');
+				scale *= 10;
+			}
+			for (carry = chunk, j = 0; j < rn; j++) {
+				carry += (uint64_t)r[j] * scale;
+				r[j] = (uint32_t)carry;
+				carry >>= 32;
+			}
+			if (carry) r[rn++] = (uint32_t)carry;
+			i = 9;
+		}
+		return rn;
+	}
+	/* the high digits times 10^low plus the low ones */
+	while (9 * ((size_t)2 << k) < n) k++;
+	low = 9 * ((size_t)1 << k);
+	p = big_power(k);
+	hi = malloc(((n - low) / 9 + 2) * sizeof(uint32_t));
+	hn = big_from_decimal(s, n - low, hi);
+	rn = big_from_decimal(s + n - low, low, r);
+	t = malloc((hn + p->size) * sizeof(uint32_t));
+	big_mul(hi, hn, p->digit, p->size, t);
+	tn = big_trim(t, hn + p->size);
+	rn = big_add(t, tn, r, rn, r);
+	free(hi);
+	free(t);
+	return rn;
+}
+
+/* Returns the integer with the magnitude digit, which it takes, and the
+ * sign, as a fixnum if it fits in one. */
+atom make_bignum(int sign, uint32_t *digit, size_t n)
+{
+	struct bignum *b;
+	n = big_trim(digit, n);
+	if (n <= 2) {
+		uint64_t u = (n > 1 ? (uint64_t)digit[1] << 32 : 0) | (n ? digit[0] : 0);
+		if (u == 0 || (sign > 0 ? u <= (uint64_t)FIXNUM_MAX : u - 1 <= (uint64_t)FIXNUM_MAX)) {
+			free(digit);
+			return make_fixnum(sign > 0 || u == 0 ? (int64_t)u : -(int64_t)(u - 1) - 1);
+		}
+	}
+	b = slab_alloc(&bignum_class);
+	b->digit = realloc(digit, n * sizeof(uint32_t));
+	b->size = (uint32_t)n;
+	b->sign = sign;
+	gc_account(b, n * sizeof(uint32_t));
+	nursery_count++;
+	return atom_of(T_BIGNUM, bignum, b);
+}
+
+/* The magnitude and sign of an integer, in buf for a fixnum. */
+const uint32_t *integer_digits(atom a, uint32_t *buf, size_t *n, int *sign)
+{
+	int64_t v;
+	uint64_t u;
+	if (atom_type(a) == T_BIGNUM) {
+		*n = atom_bignum(a)->size;
+		*sign = atom_bignum(a)->sign;
+		return atom_bignum(a)->digit;
+	}
+	v = atom_fixnum(a);
+	u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+	buf[0] = (uint32_t)u;
+	buf[1] = (uint32_t)(u >> 32);
+	*n = big_trim(buf, 2);
+	*sign = v < 0 ? -1 : 1;
+	return buf;
+}
+
+/* a + b, or a - b if negate */
+atom integer_add(atom a, atom b, int negate)
+{
+	uint32_t abuf[2], bbuf[2], *r;
+	size_t an, bn;
+	int as, bs;
+	const uint32_t *x = integer_digits(a, abuf, &an, &as), *y = integer_digits(b, bbuf, &bn, &bs);
+	if (negate) bs = -bs;
+	r = malloc(((an > bn ? an : bn) + 1) * sizeof(uint32_t));
+	if (as == bs) return make_bignum(as, r, big_add(x, an, y, bn, r));
+	if (big_cmp(x, an, y, bn) >= 0) return make_bignum(as, r, big_sub(x, an, y, bn, r));
+	return make_bignum(bs, r, big_sub(y, bn, x, an, r));
+}
+
+atom integer_mul(atom a, atom b)
+{
+	uint32_t abuf[2], bbuf[2], *r;
+	size_t an, bn;
+	int as, bs;
+	const uint32_t *x = integer_digits(a, abuf, &an, &as), *y = integer_digits(b, bbuf, &bn, &bs);
+	r = malloc((an + bn + 1) * sizeof(uint32_t));
+	big_mul(x, an, y, bn, r);
+	return make_bignum(as * bs, r, an + bn);
+}
+
+int integer_compare(atom a, atom b)
+{
+	uint32_t abuf[2], bbuf[2];
+	size_t an, bn;
+	int as, bs, c;
+	const uint32_t *x = integer_digits(a, abuf, &an, &as), *y = integer_digits(b, bbuf, &bn, &bs);
+	if (as != bs && (an || bn)) return as < bs ? -1 : 1;
+	c = big_cmp(x, an, y, bn);
+	return as > 0 ? c : -c;
+}
+
+/* Sets q to a / b and returns 1 if b divides a. */
+int integer_divide(atom a, atom b, atom *q)
+{
+	uint32_t abuf[2], bbuf[2], *qd, *r;
+	size_t an, bn;
+	int as, bs;
+	const uint32_t *x, *y;
+	if (atom_type(a) == T_FIXNUM && atom_type(b) == T_FIXNUM) {
+		int64_t n = atom_fixnum(a), d = atom_fixnum(b);
+		if (d == 0) return 0;
+		if (d != -1 || n != INT64_MIN) {
+			if (n % d != 0) return 0;
+			*q = make_fixnum(n / d);
+			return 1;
+		}
+	}
+	x = integer_digits(a, abuf, &an, &as);
+	y = integer_digits(b, bbuf, &bn, &bs);
+	if (bn == 0 || an < bn) {
+		if (bn == 0 || an != 0) return 0;
+		*q = make_fixnum(0);
+		return 1;
+	}
+	qd = malloc((an - bn + 1) * sizeof(uint32_t));
+	r = malloc(bn * sizeof(uint32_t));
+	big_divmod(x, an, y, bn, qd, r);
+	if (big_trim(r, bn) != 0) {
+		free(qd);
+		free(r);
+		return 0;
+	}
+	free(r);
+	*q = make_bignum(as * bs, qd, an - bn + 1);
+	return 1;
+}
+
+/* a mod b for b other than 0, with the sign of b */
+atom integer_mod(atom a, atom b)
+{
+	uint32_t abuf[2], bbuf[2], *r;
+	size_t an, bn, rn;
+	int as, bs;
+	const uint32_t *x, *y;
+	if (atom_type(a) == T_FIXNUM && atom_type(b) == T_FIXNUM) {
+		int64_t m = atom_fixnum(a), n = atom_fixnum(b);
+		int64_t rem = n == -1 ? 0 : m % n;
+		if (rem != 0 && (rem < 0) != (n < 0)) rem += n;
+		return make_fixnum(rem);
+	}
+	x = integer_digits(a, abuf, &an, &as);
+	y = integer_digits(b, bbuf, &bn, &bs);
+	r = malloc((bn + 1) * sizeof(uint32_t));
+	if (an < bn) {
+		memcpy(r, x, an * sizeof(uint32_t));
+		rn = an;
+	}
+	else {
+		uint32_t *q = malloc((an - bn + 1) * sizeof(uint32_t));
+		big_divmod(x, an, y, bn, q, r);
+		rn = big_trim(r, bn);
+		free(q);
+	}
+	/* the remainder of the division has the sign of a */
+	if (rn && as != bs) rn = big_sub(y, bn, r, rn, r);
+	return make_bignum(bs, r, rn);
+}
+
+/* Sets result to a^n for n >= 0 unless it would be too large. */
+int integer_expt(atom a, int64_t n, atom *result)
+{
+	uint32_t abuf[2], *r, *x, *t, *swap;
+	size_t an, rn = 1, xn, capacity;
+	int as, sign;
+	const uint32_t *base = integer_digits(a, abuf, &an, &as);
+	if (an > 0 && (double)an * (double)n > BIG_MAX_DIGITS) return 0;
+	sign = as < 0 && (n & 1) ? -1 : 1;
+	capacity = an * (size_t)n + 2;
+	r = malloc(capacity * sizeof(uint32_t));
+	x = malloc(capacity * sizeof(uint32_t));
+	t = malloc(capacity * sizeof(uint32_t));
+	r[0] = 1;
+	memcpy(x, base, an * sizeof(uint32_t));
+	xn = an;
+	/* by squaring */
+	while (n > 0) {
+		if (n & 1) {
+			big_mul(r, rn, x, xn, t);
+			rn = big_trim(t, rn + xn);
+			swap = r, r = t, t = swap;
+		}
+		n >>= 1;
+		if (n == 0) break;
+		big_mul(x, xn, x, xn, t);
+		xn = big_trim(t, 2 * xn);
+		swap = x, x = t, t = swap;
+	}
+	free(x);
+	free(t);
+	*result = make_bignum(sign, r, rn);
+	return 1;
+}
+
+/* Returns the integral double x as an integer, unless it is infinite or NaN. */
+atom make_integer(double x)
+{
+	uint32_t *digit;
+	if (x > -9223372036854775808.0 && x < 9223372036854775808.0) return make_fixnum((int64_t)x);
+	if (x != x || x - x != 0) return make_number(x); /* NaN or infinite */
+	digit = malloc(33 * sizeof(uint32_t));
+	return make_bignum(x < 0 ? -1 : 1, digit, big_from_double(x, digit));
+}
+
+double number_value(atom a)
+{
+	switch (atom_type(a)) {
+	case T_FIXNUM:
+		return (double)atom_fixnum(a);
+	case T_BIGNUM:
+		return atom_bignum(a)->sign * big_double(atom_bignum(a)->digit, atom_bignum(a)->size);
+	default:
+		return atom_number(a);
+	}
+}
+
+/* for indexes and counts */
+int64_t integer_value(atom a)
+{
+	if (atom_type(a) == T_FIXNUM) return atom_fixnum(a);
+	if (atom_type(a) == T_BIGNUM) return atom_bignum(a)->sign > 0 ? INT64_MAX : INT64_MIN;
+	if (atom_type(a) == T_NUM) return (int64_t)atom_number(a);
+	return 0;
+}
+
+/* Compares a bignum with a double exactly. Returns 2 for NaN. */
+int bignum_compare_double(atom a, double x)
+{
+	struct bignum *b = atom_bignum(a);
+	double y = number_value(a);
+	uint32_t buf[33];
+	size_t n;
+	int c;
+	if (x != x) return 2;
+	if (y != x) return y < x ? -1 : 1;
+	if (x - x != 0) return x > 0 ? -1 : 1; /* rounded to infinity */
+	/* x is a rounding of the bignum, so an integer */
+	n = big_from_double(x, buf);
+	c = big_cmp(b->digit, b->size, buf, n);
+	return b->sign > 0 ? c : -c;
+}
+
+/* Parses a whole number literal. Integers are exact. */
+int parse_number(const char *start, const char *end, atom *result)
+{
+	const char *p = start, *q;
+	char *e;
+	double val;
+	int sign = 1;
+	if (p < end && (*p == '-' || *p == '+')) sign = *p++ == '-' ? -1 : 1;
+	for (q = p; q < end && *q >= '0' && *q <= '9'; q++);
+	if (q == end && q > p) {
+		size_t n = end - p;
+		if (n <= 18) {
+			int64_t v = 0;
+			for (; p < end; p++) v = v * 10 + (*p - '0');
+			*result = make_fixnum(sign * v);
+		}
+		else {
+			uint32_t *digit = malloc((n / 9 + 2) * sizeof(uint32_t));
+			*result = make_bignum(sign, digit, big_from_decimal(p, n, digit));
+		}
+		return 1;
+	}
+	val = strtod(start, &e);
+	if (e != end || e == start) return 0;
+	*result = make_number(val);
+	return 1;
+}
+
+/* Converts text to an integer, reading a prefix if it is not a number. */
+atom string_integer(const char *s)
+{
+	atom a;
+	if (parse_number(s, s + strlen(s), &a)) return atom_type(a) == T_NUM ? make_integer(trunc(atom_number(a))) : a;
+	return make_fixnum(strtoll(s, NULL, 10));
+}
+
+/* FNV-1a */
+size_t symbol_hash(const char *s)
+{
+	size_t h = (size_t)14695981039346656037ULL;
+	for (; *s; s++) {
+		h ^= (unsigned char)*s;
+		h *= (size_t)1099511628211ULL;
 	}
-	alloc_count = alloc_count_old;
+	return h;
 }
 
+/* Returns the slot of the name, or the empty slot to intern it in. */
+size_t symbol_slot(const char *s, size_t hash)
+{
+	size_t mask = symbol_capacity - 1, i;
+	for (i = hash & mask; symbol_table[i]; i = (i + 1) & mask) {
+		if (symbol_table[i]->hash == hash && strcmp(symbol_table[i]->name, s) == 0) break;
+	}
+	return i;
+}
 
-atom make_number(double x)
+/* Replaces symbol_table with one of the given symbols. */
+void symbol_rehash(struct symbol **syms, size_t n, size_t capacity)
 {
-	atom a;
-	a.type = T_NUM;
-	a.value.number = x;
-	return a;
+	size_t i;
+	free(symbol_table);
+	symbol_table = calloc(capacity, sizeof(struct symbol *));
+	symbol_capacity = capacity;
+	symbol_size = n;
+	for (i = 0; i < n; i++) {
+		symbol_table[symbol_slot(syms[i]->name, syms[i]->hash)] = syms[i];
+	}
 }
 
+/* A symbol found during marking may have been unreachable, so it is
+ * marked as if it were new. */
 atom make_sym(const char *s)
 {
-	atom a;
+	struct symbol *sym;
+	size_t hash = symbol_hash(s), i = symbol_slot(s, hash), len;
 
-	int i;
-	for (i = symbol_size - 1; i >= 0; i--) { /* compare recent symbol first */
-		char *s2 = symbol_table[i];
-		if (strcmp(s2, s) == 0) {
-			a.type = T_SYM;
-			a.value.symbol = s2;
-			return a;
-		}
+	if (symbol_table[i]) {
+		symbol_table[i]->mark = 1;
+		return atom_of(T_SYM, symbol, symbol_table[i]->name);
 	}
 
-	a.type = T_SYM;
-	a.value.symbol = (char*)strdup(s);
-	if (symbol_size >= symbol_capacity) {
-		symbol_capacity *= 2;
-		symbol_table = realloc(symbol_table, symbol_capacity * sizeof(char *));
+	if ((symbol_size + 1) * 2 > symbol_capacity) {
+		struct symbol **syms = malloc(symbol_size * sizeof(struct symbol *));
+		size_t j, n = 0;
+		for (j = 0; j < symbol_capacity; j++) {
+			if (symbol_table[j]) syms[n++] = symbol_table[j];
+		}
+		symbol_rehash(syms, n, symbol_capacity * 2);
+		free(syms);
+		i = symbol_slot(s, hash);
 	}
-	symbol_table[symbol_size] = a.value.symbol;
+	len = strlen(s);
+	sym = malloc(sizeof(struct symbol) + len + 1);
+	heap_bytes += sizeof(struct symbol) + len + 1;
+	sym->hash = hash;
+	sym->mark = 1;
+	sym->permanent = 0;
+	sym->uninterned = 0;
+	memcpy(sym->name, s, len + 1);
+	symbol_table[i] = sym;
 	symbol_size++;
-	return a;
+	return atom_of(T_SYM, symbol, sym->name);
+}
+
+/* Returns a symbol that is not interned, so it differs from every other.
+ * Its name is only made if it is printed. */
+atom make_uniq()
+{
+	struct symbol *sym = malloc(sizeof(struct symbol) + UNIQ_NAME_SIZE);
+	heap_bytes += sizeof(struct symbol) + UNIQ_NAME_SIZE;
+	sym->hash = ++uniq_count;
+	sym->mark = 1;
+	sym->permanent = 0;
+	sym->uninterned = 1;
+	sym->name[0] = 0;
+	uniq_size++;
+	if (uniq_size > uniq_capacity) {
+		uniq_capacity = uniq_size * 2;
+		uniq_symbols = realloc(uniq_symbols, uniq_capacity * sizeof(struct symbol *));
+	}
+	uniq_symbols[uniq_size - 1] = sym;
+	return atom_of(T_SYM, symbol, sym->name);
+}
+
+char *symbol_name(char *s)
+{
+	struct symbol *sym = symbol_of(s);
+	if (sym->uninterned && !s[0]) sprintf(s, "_uniq%zu", sym->hash);
+	return s;
 }
 
 atom make_builtin(builtin fn)
 {
-	atom a;
-	a.type = T_BUILTIN;
-	a.value.builtin = fn;
-	return a;
+	return atom_of(T_BUILTIN, builtin, fn);
 }
 
 error make_closure(atom env, atom args, atom body, atom *result)
@@ -298,9 +2718,9 @@ error make_closure(atom env, atom args, atom body, atom *result)
 	/* Check argument names are all symbols or conses */
 	p = args;
 	while (!no(p)) {
-		if (p.type == T_SYM)
+		if (atom_type(p) == T_SYM)
 			break;
-		else if (p.type != T_CONS || (car(p).type != T_SYM && car(p).type != T_CONS))
+		else if (atom_type(p) != T_CONS || (atom_type(car(p)) != T_SYM && atom_type(car(p)) != T_CONS))
 			return ERROR_TYPE;
 		p = cdr(p);
 	}
@@ -315,68 +2735,168 @@ error make_closure(atom env, atom args, atom body, atom *result)
 	else {
 		p = cons(sym_do, body);
 	}
-	*result = cons(env, cons(args, p));
-	result->type = T_CLOSURE;
+	p = cons(env, cons(args, p));
+	*result = atom_of(T_CLOSURE, pair, atom_pair(p));
 
 	return ERROR_OK;
 }
 
-atom make_string(char *x)
+/* Returns a string of the len bytes at x. */
+atom make_string_copy(const char *x, size_t len)
+{
+	struct str *s = slab_alloc(&str_class);
+	if (len < STR_INLINE) {
+		s->value = s->small;
+		s->capacity = 0;
+	}
+	else {
+		s->value = malloc(len + 1);
+		s->capacity = (uint32_t)(len + 1);
+	}
+	memcpy(s->value, x, len);
+	s->value[len] = 0;
+	s->len = (uint32_t)len;
+	gc_account(s, s->capacity);
+	nursery_count++;
+	return atom_of(T_STRING, str, s);
+}
+
+/* Returns a string of the len bytes at x, which it takes. x is allocated
+ * with a NUL after them. */
+atom make_string_len(char *x, size_t len)
 {
-	atom a;
 	struct str *s;
-	alloc_count++;
-	s = a.value.str = malloc(sizeof(struct str));
+	atom a;
+	if (len < STR_INLINE) {
+		a = make_string_copy(x, len);
+		free(x);
+		return a;
+	}
+	s = slab_alloc(&str_class);
 	s->value = x;
-	s->mark = 0;
-	s->next = str_head;
-	str_head = s;
+	s->len = (uint32_t)len;
+	s->capacity = (uint32_t)(len + 1);
+	gc_account(s, s->capacity);
+	nursery_count++;
+	return atom_of(T_STRING, str, s);
+}
 
-	a.type = T_STRING;
-	stack_add(a);
-	return a;
+atom make_string(char *x)
+{
+	return make_string_len(x, strlen(x));
+}
+
+/* Returns the len bytes of a from start without copying them. The first
+ * slice of a string moves its bytes to a parent that nothing else can
+ * reach, so that sref on the string or on a slice copies what it changes. */
+atom make_slice(atom a, size_t start, size_t len)
+{
+	struct str *s = atom_str(a), *slice;
+	if (len < STR_INLINE) return make_string_copy(s->value + start, len);
+	if (!str_slice(s)) {
+		struct str *parent = slab_alloc(&str_class);
+		struct slab *ps = slab_of(parent);
+		parent->value = s->value;
+		parent->len = s->len;
+		parent->capacity = s->capacity;
+		/* the bytes stay as old as s, so s is not the only path to a young object */
+		if (gc_marked(s)) bit_set(ps->mark, slab_index(ps, parent));
+		else if (gc_marked(parent)) marked_payload += parent->capacity;
+		nursery_count++;
+		s->capacity = 0;
+		s->parent = parent;
+	}
+	slice = slab_alloc(&str_class);
+	slice->value = s->value + start;
+	slice->len = (uint32_t)len;
+	slice->capacity = 0;
+	slice->parent = s->parent;
+	nursery_count++;
+	if (gc_phase == GC_MARKING) gc_shade(atom_of(T_STRING, str, slice->parent)); /* slice is black */
+	return atom_of(T_STRING, str, slice);
+}
+
+/* Gives a slice bytes of its own. */
+void str_own(struct str *s)
+{
+	char *x;
+	if (!str_slice(s)) return;
+	x = malloc(s->len + 1);
+	memcpy(x, s->value, s->len);
+	x[s->len] = 0;
+	s->value = x;
+	s->capacity = s->len + 1;
+	gc_account(s, s->capacity);
+}
+
+/* Returns the bytes of a string followed by a NUL. */
+char *string_value(atom a)
+{
+	struct str *s = atom_str(a);
+	if (s->value[s->len] != 0) str_own(s);
+	return s->value;
+}
+
+/* Ports of streams opened by Arc code are owned and closed when collected. */
+atom make_port(enum type type, FILE *fp, int owned) {
+	struct port *p = slab_alloc(&port_class);
+	p->fp = fp;
+	p->pipe = type == T_INPUT_PIPE;
+	p->owned = (char)owned;
+	if (owned) open_ports++;
+	nursery_count++;
+	return atom_of(type, port, p);
 }
 
 atom make_input(FILE *fp) {
-	atom a;
-	a.type = T_INPUT;
-	a.value.fp = fp;
-	return a;
+	return make_port(T_INPUT, fp, fp != stdin);
 }
 
 atom make_input_pipe(FILE *fp) {
-	atom a;
-	a.type = T_INPUT_PIPE;
-	a.value.fp = fp;
-	return a;
+	return make_port(T_INPUT_PIPE, fp, 1);
 }
 
 atom make_output(FILE *fp) {
-	atom a;
-	a.type = T_OUTPUT;
-	a.value.fp = fp;
-	return a;
+	return make_port(T_OUTPUT, fp, fp != stdout && fp != stderr);
+}
+
+/* Returns the open stream of a port, or NULL. */
+FILE *port_fp(atom a) {
+	return is_port(a) ? atom_port(a)->fp : NULL;
+}
+
+/* Opens a file or a pipe. When out of descriptors, collects the leaked
+ * ports so that their finalizers close them, and tries again. */
+FILE *port_open(const char *path, const char *mode, int pipe) {
+	FILE *fp = pipe ? popen(path, mode) : fopen(path, mode);
+	if (!fp && (errno == EMFILE || errno == ENFILE)) {
+		gc();
+		gc_sweep_all();
+		fp = pipe ? popen(path, mode) : fopen(path, mode);
+	}
+	return fp;
 }
 
 atom make_char(char c) {
-	atom a;
-	a.type = T_CHAR;
-	a.value.ch = c;
-	return a;
+	return atom_of(T_CHAR, ch, (unsigned char)c);
 }
 
 void print_expr(atom a)
 {
-	char *s = to_string(a, 1);
-	printf("%s", s);
-	free(s);
+	struct string s;
+	string_new(&s);
+	string_print(&s, a, 1);
+	fwrite(s.str, 1, s.len, stdout);
+	free(s.str);
 }
 
 void pr(atom a)
 {
-	char *s = to_string(a, 0);
-	printf("%s", s);
-	free(s);
+	struct string s;
+	string_new(&s);
+	string_print(&s, a, 0);
+	fwrite(s.str, 1, s.len, stdout);
+	free(s.str);
 }
 
 error lex(const char *str, const char **start, const char **end)
@@ -422,17 +2942,11 @@ start:
 
 error parse_simple(const char *start, const char *end, atom *result)
 {
-	char *p;
-
 	/* Is it a number? */
-	double val = strtod(start, &p);
-	if (p == end) {
-		result->type = T_NUM;
-		result->value.number = val;
+	if (parse_number(start, end, result)) {
 		return ERROR_OK;
 	}
 	else if (start[0] == '"') { /* "string" */
-		result->type = T_STRING;
 		size_t length = end - start - 2;
 		char *buf = (char*)malloc(length + 1);
 		const char *ps = start + 1;
@@ -462,8 +2976,8 @@ error parse_simple(const char *start, const char *end, atom *result)
 			pt++;
 		}
 		*pt = 0;
-		buf = realloc(buf, pt - buf + 1);
-		*result = make_string(buf);
+		size_t n = pt - buf;
+		*result = make_string_len(realloc(buf, n + 1), n);
 		return ERROR_OK;
 	}
 	else if (start[0] == '#') { /* #\char */
@@ -770,7 +3284,7 @@ atom env_create_cap(atom parent, size_t capacity)
 error env_get(atom env, char *symbol, atom *result)
 {
 	while (1) {
-		struct table *ptbl = cdr(env).value.table;
+		struct table *ptbl = atom_table(cdr(env));
 		struct table_entry *a = table_get_sym(ptbl, symbol);
 		if (a) {
 			*result = a->v;
@@ -785,7 +3299,7 @@ error env_get(atom env, char *symbol, atom *result)
 }
 
 error env_assign(atom env, char *symbol, atom value) {
-	struct table *ptbl = cdr(env).value.table;
+	struct table *ptbl = atom_table(cdr(env));
 	table_set_sym(ptbl, symbol, value);
 	return ERROR_OK;
 }
@@ -793,10 +3307,11 @@ error env_assign(atom env, char *symbol, atom value) {
 error env_assign_eq(atom env, char *symbol, atom value) {
 	while (1) {
 		atom parent = car(env);
-		struct table *ptbl = cdr(env).value.table;
+		struct table *ptbl = atom_table(cdr(env));
 		struct table_entry *a = table_get_sym(ptbl, symbol);
 		if (a) {
 			a->v = value;
+			gc_write_barrier(cdr(env));
 			return ERROR_OK;
 		}
 		if (no(parent)) {
@@ -810,7 +3325,7 @@ int listp(atom expr)
 {
 	atom *p = &expr;
 	while (!no(*p)) {
-		if (p->type != T_CONS)
+		if (atom_type(*p) != T_CONS)
 			return 0;
 		p = &cdr(*p);
 	}
@@ -821,7 +3336,7 @@ size_t len(atom xs) {
 	atom *p = &xs;
 	size_t ret = 0;
 	while (!no(*p)) {
-		if (p->type != T_CONS)
+		if (atom_type(*p) != T_CONS)
 			return ret + 1;
 		p = &cdr(*p);
 		ret++;
@@ -844,7 +3359,7 @@ atom copy_list(atom list)
 		cdr(p) = cons(car(list), nil);
 		p = cdr(p);
 		list = cdr(list);
-		if (list.type != T_CONS) { /* improper list */
+		if (atom_type(list) != T_CONS) { /* improper list */
 			p = list;
 			break;
 		}
@@ -854,9 +3369,9 @@ atom copy_list(atom list)
 }
 
 error destructuring_bind(atom arg_name, atom val, int val_unspecified, atom env) {
-	switch (arg_name.type) {
+	switch (atom_type(arg_name)) {
 	case T_SYM:
-		return env_assign(env, arg_name.value.symbol, val);
+		return env_assign(env, atom_symbol(arg_name), val);
 	case T_CONS:
 		if (is(car(arg_name), sym_o)) { /* (o ARG [DEFAULT]) */
 			if (val_unspecified) { /* missing argument */
@@ -865,10 +3380,10 @@ error destructuring_bind(atom arg_name, atom val, int val_unspecified, atom env)
 					if (err) return err;
 				}
 			}
-			return env_assign(env, car(cdr(arg_name)).value.symbol, val);
+			return env_assign(env, atom_symbol(car(cdr(arg_name))), val);
 		}
 		else {
-			if (val.type != T_CONS) {
+			if (atom_type(val) != T_CONS) {
 				return ERROR_ARGS;
 			}
 			error err = destructuring_bind(car(arg_name), car(val), 0, env);
@@ -889,8 +3404,8 @@ error env_bind(atom env, atom arg_names, struct vector *vargs) {
 	/* Bind the arguments */
 	size_t i = 0;
 	while (!no(arg_names)) {
-		if (arg_names.type == T_SYM) {
-			env_assign(env, arg_names.value.symbol, vector_to_atom(vargs, i));
+		if (atom_type(arg_names) == T_SYM) {
+			env_assign(env, atom_symbol(arg_names), vector_to_atom(vargs, i));
 			i = vargs->size;
 			break;
 		}
@@ -919,39 +3434,46 @@ error env_bind(atom env, atom arg_names, struct vector *vargs) {
 
 error apply(atom fn, struct vector *vargs, atom *result)
 {
-	if (fn.type == T_BUILTIN)
-		return (*fn.value.builtin)(vargs, result);
-	else if (fn.type == T_CLOSURE) {		
+	if (atom_type(fn) == T_BUILTIN)
+		return (*atom_builtin(fn))(vargs, result);
+	else if (atom_type(fn) == T_CLOSURE) {		
 		atom arg_names = car(cdr(fn));
 		atom env = env_create(car(fn));
 		atom body = cdr(cdr(fn));
+		struct root_frame frame; /* a default that tail calls drops env from its frame */
+		root_frame_push(&frame);
+		frame.atoms[0] = &fn;
+		frame.atoms[1] = &env;
 
 		error err = env_bind(env, arg_names, vargs);
 		if (err) {
+			root_frame_pop(&frame);
 			return err;
 		}
 
 		/* Evaluate the body */
 		err = eval_expr(body, env, result);
+		root_frame_pop(&frame);
 		if (err) {
 			return err;
 		}
 		return ERROR_OK;
 	}
-	else if (fn.type == T_CONTINUATION) {
+	else if (atom_type(fn) == T_CONTINUATION) {
 		if (vargs->size != 1) return ERROR_ARGS;
 		thrown = vargs->data[0];
-		longjmp(*fn.value.jb, 1);
+		longjmp(*atom_jb(fn), 1);
 	}
-	else if (fn.type == T_STRING) { /* implicit indexing for string */
+	else if (atom_type(fn) == T_STRING) { /* implicit indexing for string */
 		if (vargs->size != 1) return ERROR_ARGS;
-		size_t index = (size_t)(vargs->data[0]).value.number;
-		*result = make_char(fn.value.str->value[index]);
+		size_t index = (size_t)integer_value(vargs->data[0]);
+		if (index >= atom_str(fn)->len) return ERROR_ARGS;
+		*result = make_char(atom_str(fn)->value[index]);
 		return ERROR_OK;
 	}
-	else if (fn.type == T_CONS && listp(fn)) { /* implicit indexing for list */
+	else if (atom_type(fn) == T_CONS && listp(fn)) { /* implicit indexing for list */
 		if (vargs->size != 1) return ERROR_ARGS;
-		size_t index = (size_t)(vargs->data[0]).value.number;
+		size_t index = (size_t)integer_value(vargs->data[0]);
 		atom a = fn;
 		size_t i;
 		for (i = 0; i < index; i++) {
@@ -964,10 +3486,10 @@ error apply(atom fn, struct vector *vargs, atom *result)
 		*result = car(a);
 		return ERROR_OK;
 	}
-	else if (fn.type == T_TABLE) { /* implicit indexing for table */
+	else if (atom_type(fn) == T_TABLE) { /* implicit indexing for table */
 		long len1 = vargs->size;
 		if (len1 != 1 && len1 != 2) return ERROR_ARGS;
-		struct table_entry *pair = table_get(fn.value.table, vargs->data[0]);
+		struct table_entry *pair = table_get(atom_table(fn), vargs->data[0]);
 		if (pair) {
 			*result = pair->v;
 		}
@@ -992,7 +3514,7 @@ error builtin_car(struct vector *vargs, atom *result)
 	atom a = vargs->data[0];
 	if (no(a))
 		*result = nil;
-	else if (a.type != T_CONS)
+	else if (atom_type(a) != T_CONS)
 		return ERROR_TYPE;
 	else
 		*result = car(a);
@@ -1008,7 +3530,7 @@ error builtin_cdr(struct vector *vargs, atom *result)
 	atom a = vargs->data[0];
 	if (no(a))
 		*result = nil;
-	else if (a.type != T_CONS)
+	else if (atom_type(a) != T_CONS)
 		return ERROR_TYPE;
 	else
 		*result = cdr(a);
@@ -1042,6 +3564,35 @@ atom append(atom a, atom b) {
 	return nil;
 }
 
+/* Applies op, which is '+', '-' or '*', to acc and each number of vargs
+ * from start on. The result stays exact while the numbers are integers,
+ * and is a double after that. */
+error arith_fold(char op, atom acc, struct vector *vargs, size_t start, atom *result)
+{
+	size_t i;
+	for (i = start; i < vargs->size; i++) {
+		atom x = vargs->data[i];
+		int64_t n;
+		if (atom_type(acc) == T_FIXNUM && atom_type(x) == T_FIXNUM) {
+			int64_t m = atom_fixnum(acc), k = atom_fixnum(x);
+			if (op == '+' ? fixnum_add(m, k, &n) : op == '-' ? fixnum_sub(m, k, &n) : fixnum_mul(m, k, &n)) {
+				acc = make_fixnum(n);
+				continue;
+			}
+		}
+		if (!is_number(x)) return ERROR_TYPE;
+		if (is_integer(acc) && is_integer(x)) {
+			acc = op == '*' ? integer_mul(acc, x) : integer_add(acc, x, op == '-');
+		}
+		else {
+			double r = number_value(acc), y = number_value(x);
+			acc = make_number(op == '+' ? r + y : op == '-' ? r - y : r * y);
+		}
+	}
+	*result = acc;
+	return ERROR_OK;
+}
+
 /*
 + args
 Addition. This operator also performs string and list concatenation.
@@ -1049,30 +3600,28 @@ Addition. This operator also performs string and list concatenation.
 error builtin_add(struct vector *vargs, atom *result)
 {
 	if (vargs->size == 0) {
-		*result = make_number(0);
+		*result = make_fixnum(0);
 	}
 	else {
-		if (vargs->data[0].type == T_NUM) {
-			double r = vargs->data[0].value.number;
-			size_t i;
-			for (i = 1; i < vargs->size; i++) {
-				if (vargs->data[i].type != T_NUM) return ERROR_TYPE;
-				r += vargs->data[i].value.number;
-			}
-			*result = make_number(r);
+		if (is_number(vargs->data[0])) {
+			return arith_fold('+', make_fixnum(0), vargs, 0, result);
 		}
-		else if (vargs->data[0].type == T_STRING) {
+		else if (atom_type(vargs->data[0]) == T_STRING) {
 			struct string buf;
-			string_new(&buf);
-			size_t i;
+			size_t i, size = 0;
 			for (i = 0; i < vargs->size; i++) {
-				char *s = to_string(vargs->data[i], 0);
-				string_cat(&buf, s);
-				free(s);
+				if (atom_type(vargs->data[i]) == T_STRING) size += atom_str(vargs->data[i])->len;
 			}
-			*result = make_string(buf.str);
+			if (size >= UINT32_MAX || !gc_reserve(size + 1)) return ERROR_MEMORY;
+			string_new(&buf);
+			for (i = 0; i < vargs->size; i++) string_print(&buf, vargs->data[i], 0);
+			if (buf.len >= UINT32_MAX) {
+				free(buf.str);
+				return ERROR_MEMORY;
+			}
+			*result = make_string_len(buf.str, buf.len);
 		}
-		else if (vargs->data[0].type == T_CONS || vargs->data[0].type == T_NIL) {
+		else if (atom_type(vargs->data[0]) == T_CONS || atom_type(vargs->data[0]) == T_NIL) {
 			atom acc = nil;
 			size_t i;
 			for (i = 0; i < vargs->size; i++) {
@@ -1087,57 +3636,73 @@ error builtin_add(struct vector *vargs, atom *result)
 error builtin_subtract(struct vector *vargs, atom *result)
 {
 	if (vargs->size == 0) { /* 0 argument */
-		*result = make_number(0);
+		*result = make_fixnum(0);
 		return ERROR_OK;
 	}
-	if (vargs->data[0].type != T_NUM) return ERROR_TYPE;
+	if (!is_number(vargs->data[0])) return ERROR_TYPE;
 	if (vargs->size == 1) { /* 1 argument */
-		*result = make_number(-vargs->data[0].value.number);
-		return ERROR_OK;
-	}
-	double r = vargs->data[0].value.number;
-	size_t i;
-	for (i = 1; i < vargs->size; i++) {
-		if (vargs->data[i].type != T_NUM) return ERROR_TYPE;
-		r -= vargs->data[i].value.number;
+		return arith_fold('-', make_fixnum(0), vargs, 0, result);
 	}
-	*result = make_number(r);
-	return ERROR_OK;
+	return arith_fold('-', vargs->data[0], vargs, 1, result);
 }
 
 error builtin_multiply(struct vector *vargs, atom *result)
 {
-	double r = 1;
-	size_t i;
-	for (i = 0; i < vargs->size; i++) {
-		if (vargs->data[i].type != T_NUM) return ERROR_TYPE;
-		r *= vargs->data[i].value.number;
-	}
-	*result = make_number(r);
-	return ERROR_OK;
+	return arith_fold('*', make_fixnum(1), vargs, 0, result);
 }
 
 error builtin_divide(struct vector *vargs, atom *result)
 {
+	size_t i;
+	atom acc;
 	if (vargs->size == 0) { /* 0 argument */
-		*result = make_number(1);
-		return ERROR_OK;
-	}
-	if (vargs->data[0].type != T_NUM) return ERROR_TYPE;
-	if (vargs->size == 1) { /* 1 argument */
-		*result = make_number(1.0 / vargs->data[0].value.number);
+		*result = make_fixnum(1);
 		return ERROR_OK;
 	}
-	double r = vargs->data[0].value.number;
-	size_t i;
-	for (i = 1; i < vargs->size; i++) {
-		if (vargs->data[i].type != T_NUM) return ERROR_TYPE;
-		r /= vargs->data[i].value.number;
+	if (!is_number(vargs->data[0])) return ERROR_TYPE;
+	/* 1 argument is (/ 1 x) */
+	i = vargs->size == 1 ? 0 : 1;
+	acc = i == 0 ? make_fixnum(1) : vargs->data[0];
+	for (; i < vargs->size; i++) {
+		atom x = vargs->data[i];
+		if (!is_number(x)) return ERROR_TYPE;
+		/* exact while the divisions are */
+		if (is_integer(acc) && is_integer(x) && integer_divide(acc, x, &acc)) continue;
+		acc = make_number(number_value(acc) / number_value(x));
 	}
-	*result = make_number(r);
+	*result = acc;
 	return ERROR_OK;
 }
 
+/* Returns -1, 0 or 1 as a is less than, equal to or greater than b, and 2
+ * if either is NaN. Integers compare exactly. */
+int number_compare(atom a, atom b)
+{
+	double x, y;
+	int c;
+	if (atom_type(a) == T_FIXNUM && atom_type(b) == T_FIXNUM) {
+		int64_t m = atom_fixnum(a), n = atom_fixnum(b);
+		return m < n ? -1 : m > n;
+	}
+	if (is_integer(a) && is_integer(b)) return integer_compare(a, b);
+	if (atom_type(a) == T_BIGNUM) return bignum_compare_double(a, atom_number(b));
+	if (atom_type(b) == T_BIGNUM) {
+		c = bignum_compare_double(b, atom_number(a));
+		return c == 2 ? 2 : -c;
+	}
+	x = number_value(a);
+	y = number_value(b);
+	return x < y ? -1 : x > y ? 1 : x == y ? 0 : 2;
+}
+
+/* Compares bytes, and then lengths. */
+int str_compare(struct str *a, struct str *b)
+{
+	int c = memcmp(a->value, b->value, a->len < b->len ? a->len : b->len);
+	if (c) return c;
+	return a->len < b->len ? -1 : a->len > b->len;
+}
+
 error builtin_less(struct vector *vargs, atom *result)
 {
 	if (vargs->size <= 1) {
@@ -1145,10 +3710,13 @@ error builtin_less(struct vector *vargs, atom *result)
 		return ERROR_OK;
 	}
 	size_t i;
-	switch (vargs->data[0].type) {
+	switch (atom_type(vargs->data[0])) {
 	case T_NUM:
+	case T_FIXNUM:
+	case T_BIGNUM:
 		for (i = 0; i < vargs->size - 1; i++) {
-			if (vargs->data[i].value.number >= vargs->data[i + 1].value.number) {
+			if (!is_number(vargs->data[i + 1])) return ERROR_TYPE;
+			if (number_compare(vargs->data[i], vargs->data[i + 1]) != -1) {
 				*result = nil;
 				return ERROR_OK;
 			}
@@ -1157,7 +3725,8 @@ error builtin_less(struct vector *vargs, atom *result)
 		return ERROR_OK;
 	case T_STRING:
 		for (i = 0; i < vargs->size - 1; i++) {
-			if (strcmp(vargs->data[i].value.str->value, vargs->data[i + 1].value.str->value) >= 0) {
+			if (atom_type(vargs->data[i + 1]) != T_STRING) return ERROR_TYPE;
+			if (str_compare(atom_str(vargs->data[i]), atom_str(vargs->data[i + 1])) >= 0) {
 				*result = nil;
 				return ERROR_OK;
 			}
@@ -1176,10 +3745,13 @@ error builtin_greater(struct vector *vargs, atom *result)
 		return ERROR_OK;
 	}
 	size_t i;
-	switch (vargs->data[0].type) {
+	switch (atom_type(vargs->data[0])) {
 	case T_NUM:
+	case T_FIXNUM:
+	case T_BIGNUM:
 		for (i = 0; i < vargs->size - 1; i++) {
-			if (vargs->data[i].value.number <= vargs->data[i + 1].value.number) {
+			if (!is_number(vargs->data[i + 1])) return ERROR_TYPE;
+			if (number_compare(vargs->data[i], vargs->data[i + 1]) != 1) {
 				*result = nil;
 				return ERROR_OK;
 			}
@@ -1188,7 +3760,8 @@ error builtin_greater(struct vector *vargs, atom *result)
 		return ERROR_OK;
 	case T_STRING:
 		for (i = 0; i < vargs->size - 1; i++) {
-			if (strcmp(vargs->data[i].value.str->value, vargs->data[i + 1].value.str->value) <= 0) {
+			if (atom_type(vargs->data[i + 1]) != T_STRING) return ERROR_TYPE;
+			if (str_compare(atom_str(vargs->data[i]), atom_str(vargs->data[i + 1])) <= 0) {
 				*result = nil;
 				return ERROR_OK;
 			}
@@ -1216,49 +3789,54 @@ error builtin_apply(struct vector *vargs, atom *result)
 }
 
 int is(atom a, atom b) {
-	if (a.type == b.type) {
-		switch (a.type) {
+	if (atom_type(a) != atom_type(b) && is_number(a) && is_number(b)) return number_compare(a, b) == 0;
+	if (atom_type(a) == atom_type(b)) {
+		switch (atom_type(a)) {
 		case T_NIL:
 			return 1;
 		case T_CONS:
 		case T_CLOSURE:
 		case T_MACRO:
-			return (a.value.pair == b.value.pair);
+			return (atom_pair(a) == atom_pair(b));
 		case T_SYM:
-			return (a.value.symbol == b.value.symbol);
+			return (atom_symbol(a) == atom_symbol(b));
 		case T_NUM:
-			return (a.value.number == b.value.number);
+			return (atom_number(a) == atom_number(b));
+		case T_FIXNUM:
+			return (atom_fixnum(a) == atom_fixnum(b));
+		case T_BIGNUM:
+			return integer_compare(a, b) == 0;
 		case T_BUILTIN:
-			return (a.value.builtin == b.value.builtin);
+			return (atom_builtin(a) == atom_builtin(b));
 		case T_STRING:
-			return strcmp(a.value.str->value, b.value.str->value) == 0;
+			return atom_str(a)->len == atom_str(b)->len && memcmp(atom_str(a)->value, atom_str(b)->value, atom_str(a)->len) == 0;
 		case T_CHAR:
-			return (a.value.ch == b.value.ch);
+			return (atom_char(a) == atom_char(b));
 		case T_TABLE:
-			return a.value.table == b.value.table;
+			return atom_table(a) == atom_table(b);
 		case T_INPUT:
 		case T_INPUT_PIPE:
 		case T_OUTPUT:
-			return a.value.fp == b.value.fp;
+			return atom_port(a) == atom_port(b);
 		case T_CONTINUATION:
-			return a.value.jb == b.value.jb;
+			return atom_jb(a) == atom_jb(b);
 		}
 	}
 	return 0;
 }
 
 int iso(atom a, atom b) {
-	if (a.type == b.type) {
-		switch (a.type) {
+	if (atom_type(a) == atom_type(b)) {
+		switch (atom_type(a)) {
 		case T_CONS:
 		case T_CLOSURE:
 		case T_MACRO:
-			return iso(a.value.pair->car, b.value.pair->car) && iso(a.value.pair->cdr, b.value.pair->cdr);
+			return iso(atom_pair(a)->car, atom_pair(b)->car) && iso(atom_pair(a)->cdr, atom_pair(b)->cdr);
 		default:
 			return is(a, b);
 		}
 	}
-	return 0;
+	return is(a, b); /* 1 and 1.0 */
 }
 
 error builtin_is(struct vector *vargs, atom *result)
@@ -1284,9 +3862,10 @@ error builtin_is(struct vector *vargs, atom *result)
 error builtin_scar(struct vector *vargs, atom *result) {
 	if (vargs->size != 2) return ERROR_ARGS;
 	atom place = vargs->data[0], value;
-	if (place.type != T_CONS) return ERROR_TYPE;
+	if (atom_type(place) != T_CONS) return ERROR_TYPE;
 	value = vargs->data[1];
-	place.value.pair->car = value;
+	atom_pair(place)->car = value;
+	gc_write_barrier(place);
 	*result = value;
 	return ERROR_OK;
 }
@@ -1294,9 +3873,10 @@ error builtin_scar(struct vector *vargs, atom *result) {
 error builtin_scdr(struct vector *vargs, atom *result) {
 	if (vargs->size != 2) return ERROR_ARGS;
 	atom place = vargs->data[0], value;
-	if (place.type != T_CONS) return ERROR_TYPE;
+	if (atom_type(place) != T_CONS) return ERROR_TYPE;
 	value = vargs->data[1];
-	place.value.pair->cdr = value;
+	atom_pair(place)->cdr = value;
+	gc_write_barrier(place);
 	*result = value;
 	return ERROR_OK;
 }
@@ -1305,8 +3885,14 @@ error builtin_mod(struct vector *vargs, atom *result) {
 	if (vargs->size != 2) return ERROR_ARGS;
 	atom dividend = vargs->data[0];
 	atom divisor = vargs->data[1];
-	double r = fmod(dividend.value.number, divisor.value.number);
-	if (dividend.value.number * divisor.value.number < 0 && r != 0) r += divisor.value.number;
+	if (!is_number(dividend) || !is_number(divisor)) return ERROR_TYPE;
+	if (is_integer(dividend) && is_integer(divisor) && !is(divisor, make_fixnum(0))) {
+		*result = integer_mod(dividend, divisor);
+		return ERROR_OK;
+	}
+	double x = number_value(dividend), y = number_value(divisor);
+	double r = fmod(x, y);
+	if (x * y < 0 && r != 0) r += y;
 	*result = make_number(r);
 	return ERROR_OK;
 }
@@ -1314,7 +3900,7 @@ error builtin_mod(struct vector *vargs, atom *result) {
 error builtin_type(struct vector *vargs, atom *result) {
 	if (vargs->size != 1) return ERROR_ARGS;
 	atom x = vargs->data[0];
-	switch (x.type) {
+	switch (atom_type(x)) {
 	case T_CONS: *result = sym_cons; break;
 	case T_SYM:
 	case T_NIL: *result = sym_sym; break;
@@ -1324,6 +3910,9 @@ error builtin_type(struct vector *vargs, atom *result) {
 		*result = sym_fn; break;
 	case T_STRING: *result = sym_string; break;
 	case T_NUM: *result = sym_num; break;
+	case T_FIXNUM:
+	case T_BIGNUM:
+		*result = sym_int; break;
 	case T_MACRO: *result = sym_mac; break;
 	case T_TABLE: *result = sym_table; break;
 	case T_CHAR: *result = sym_char; break;
@@ -1345,20 +3934,23 @@ error builtin_sref(struct vector *vargs, atom *result) {
 	obj = vargs->data[0];
 	value = vargs->data[1];
 	index = vargs->data[2];
-	switch (obj.type) {
+	switch (atom_type(obj)) {
 	case T_CONS:
-	  for (i=0; i<(size_t)index.value.number; i++) {
+	  for (i=0; i<(size_t)integer_value(index); i++) {
 	    obj = cdr(obj);
 	  }
 	  car(obj) = value;
+	  gc_write_barrier(obj);
 	  *result = value;
 	  return ERROR_OK;
 	case T_STRING:
-	  obj.value.str->value[(long)index.value.number] = (char)value.value.ch;
+	  if ((size_t)integer_value(index) >= atom_str(obj)->len) return ERROR_ARGS;
+	  str_own(atom_str(obj));
+	  atom_str(obj)->value[(long)integer_value(index)] = (char)atom_char(value);
 	  *result = value;
 	  return ERROR_OK;
 	case T_TABLE:
-	  table_set(obj.value.table, index, value);
+	  table_set(atom_table(obj), index, value);
 	  *result = value;
 	  return ERROR_OK;
 	default:
@@ -1378,14 +3970,17 @@ error builtin_disp(struct vector *vargs, atom *result) {
 		fp = stdout;
 		break;
 	case 2:
-		fp = vargs->data[1].value.fp;
+		fp = port_fp(vargs->data[1]);
+		if (!fp) return ERROR_TYPE;
 		break;
 	default:
 		return ERROR_ARGS;
 	}
-	char *s = to_string(vargs->data[0], 0);
-	fprintf(fp, "%s", s);
-	free(s);
+	struct string s;
+	string_new(&s);
+	string_print(&s, vargs->data[0], 0);
+	fwrite(s.str, 1, s.len, fp);
+	free(s.str);
 	*result = nil;
 	return ERROR_OK;
 }
@@ -1399,11 +3994,12 @@ error builtin_writeb(struct vector *vargs, atom *result) {
 		fp = stdout;
 		break;
 	case 2:
-		fp = vargs->data[1].value.fp;
+		fp = port_fp(vargs->data[1]);
+		if (!fp) return ERROR_TYPE;
 		break;
 	default: return ERROR_ARGS;
 	}
-	fputc((int)vargs->data[0].value.number, fp);
+	fputc((int)integer_value(vargs->data[0]), fp);
 	*result = nil;
 	return ERROR_OK;
 }
@@ -1413,7 +4009,22 @@ error builtin_expt(struct vector *vargs, atom *result) {
 	if (vargs->size != 2) return ERROR_ARGS;
 	a = vargs->data[0];
 	b = vargs->data[1];
-	*result = make_number(pow(a.value.number, b.value.number));
+	if (!is_number(a) || !is_number(b)) return ERROR_TYPE;
+	if (atom_type(a) == T_FIXNUM && atom_type(b) == T_FIXNUM && atom_fixnum(b) >= 0) {
+		/* exact by squaring, in fixnums while the result fits */
+		int64_t x = atom_fixnum(a), n = atom_fixnum(b), r = 1;
+		for (;;) {
+			if ((n & 1) && !fixnum_mul(r, x, &r)) break;
+			n >>= 1;
+			if (n == 0) {
+				*result = make_fixnum(r);
+				return ERROR_OK;
+			}
+			if (!fixnum_mul(x, x, &x)) break;
+		}
+	}
+	if (is_integer(a) && atom_type(b) == T_FIXNUM && atom_fixnum(b) >= 0 && integer_expt(a, atom_fixnum(b), result)) return ERROR_OK;
+	*result = make_number(pow(number_value(a), number_value(b)));
 	return ERROR_OK;
 }
 
@@ -1421,7 +4032,8 @@ error builtin_log(struct vector *vargs, atom *result) {
 	atom a;
 	if (vargs->size != 1) return ERROR_ARGS;
 	a = vargs->data[0];
-	*result = make_number(log(a.value.number));
+	if (!is_number(a)) return ERROR_TYPE;
+	*result = make_number(log(number_value(a)));
 	return ERROR_OK;
 }
 
@@ -1429,7 +4041,8 @@ error builtin_sqrt(struct vector *vargs, atom *result) {
 	atom a;
 	if (vargs->size != 1) return ERROR_ARGS;
 	a = vargs->data[0];
-	*result = make_number(sqrt(a.value.number));
+	if (!is_number(a)) return ERROR_TYPE;
+	*result = make_number(sqrt(number_value(a)));
 	return ERROR_OK;
 }
 
@@ -1440,8 +4053,9 @@ error builtin_readline(struct vector *vargs, atom *result) {
 		str = readline("");
 	}
 	else if (l == 1) {
-		if (vargs->data[0].type != T_INPUT && vargs->data[0].type != T_INPUT_PIPE) return ERROR_TYPE;
-		str = readline_fp("", vargs->data[0].value.fp);
+		if (atom_type(vargs->data[0]) != T_INPUT && atom_type(vargs->data[0]) != T_INPUT_PIPE) return ERROR_TYPE;
+		if (!port_fp(vargs->data[0])) return ERROR_FILE;
+		str = readline_fp("", port_fp(vargs->data[0]));
 	}
 	else {
 		return ERROR_ARGS;
@@ -1462,7 +4076,10 @@ double rand_double() {
 error builtin_rand(struct vector *vargs, atom *result) {
 	long alen = vargs->size;
 	if (alen == 0) *result = make_number(rand_double());
-	else if (alen == 1) *result = make_number(floor(rand_double() * vargs->data[0].value.number));
+	else if (alen == 1) {
+		if (!is_number(vargs->data[0])) return ERROR_TYPE;
+		*result = make_integer(floor(rand_double() * number_value(vargs->data[0])));
+	}
 	else return ERROR_ARGS;
 	return ERROR_OK;
 }
@@ -1497,13 +4114,14 @@ error builtin_read(struct vector *vargs, atom *result) {
 	}
 	else if (alen <= 2) {
 		atom src = vargs->data[0];
-		if (src.type == T_STRING) {
-			char *s = vargs->data[0].value.str->value;
+		if (atom_type(src) == T_STRING) {
+			char *s = string_value(vargs->data[0]);
 			const char *buf = s;
 			err = read_expr(buf, &buf, result);
 		}
-		else if (src.type == T_INPUT || src.type == T_INPUT_PIPE) {
-			err = read_fp(src.value.fp, result);
+		else if (atom_type(src) == T_INPUT || atom_type(src) == T_INPUT_PIPE) {
+			if (!port_fp(src)) return ERROR_FILE;
+			err = read_fp(port_fp(src), result);
 		}
 		else {
 			return ERROR_TYPE;
@@ -1547,13 +4165,9 @@ error builtin_string(struct vector *vargs, atom *result) {
 	string_new(&s);
 	size_t i;
 	for (i = 0; i < vargs->size; i++) {
-		if (!no(vargs->data[i])) {
-			char *a = to_string(vargs->data[i], 0);
-			string_cat(&s, a);
-			free(a);
-		}
+		if (!no(vargs->data[i])) string_print(&s, vargs->data[i], 0);
 	}
-	*result = make_string(s.str);
+	*result = make_string_len(s.str, s.len);
 	return ERROR_OK;
 }
 
@@ -1572,8 +4186,8 @@ error builtin_system(struct vector *vargs, atom *result) {
 	long alen = vargs->size;
 	if (alen == 1) {
 		atom a = vargs->data[0];
-		if (a.type != T_STRING) return ERROR_TYPE;
-		*result = make_number(system(vargs->data[0].value.str->value));
+		if (atom_type(a) != T_STRING) return ERROR_TYPE;
+		*result = make_fixnum(system(string_value(vargs->data[0])));
 		return ERROR_OK;
 	}
 	else return ERROR_ARGS;
@@ -1587,9 +4201,9 @@ error builtin_eval(struct vector *vargs, atom *result) {
 error builtin_load(struct vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
-		if (a.type != T_STRING) return ERROR_TYPE;
+		if (atom_type(a) != T_STRING) return ERROR_TYPE;
 		*result = nil;
-		return arc_load_file(a.value.str->value);
+		return arc_load_file(string_value(a));
 	}
 	else return ERROR_ARGS;
 }
@@ -1597,18 +4211,22 @@ error builtin_load(struct vector *vargs, atom *result) {
 error builtin_int(struct vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
-		switch (a.type) {
+		switch (atom_type(a)) {
 		case T_STRING:
-			*result = make_number(atol(a.value.str->value));
+			*result = string_integer(string_value(a));
 			break;
 		case T_SYM:
-			*result = make_number(atol(a.value.symbol));
+			*result = string_integer(symbol_name(atom_symbol(a)));
 			break;
 		case T_NUM:
-			*result = make_number((long)a.value.number);
+			*result = make_integer(trunc(atom_number(a)));
+			break;
+		case T_FIXNUM:
+		case T_BIGNUM:
+			*result = a;
 			break;
 		case T_CHAR:
-			*result = make_number(a.value.ch);
+			*result = make_fixnum(atom_char(a));
 			break;
 		default:
 			return ERROR_TYPE;
@@ -1621,8 +4239,9 @@ error builtin_int(struct vector *vargs, atom *result) {
 error builtin_trunc(struct vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
-		if (a.type != T_NUM) return ERROR_TYPE;
-		*result = make_number(trunc(a.value.number));
+		if (is_integer(a)) *result = a;
+		else if (atom_type(a) == T_NUM) *result = make_integer(trunc(atom_number(a)));
+		else return ERROR_TYPE;
 		return ERROR_OK;
 	}
 	else return ERROR_ARGS;
@@ -1631,8 +4250,8 @@ error builtin_trunc(struct vector *vargs, atom *result) {
 error builtin_sin(struct vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
-		if (a.type != T_NUM) return ERROR_TYPE;
-		*result = make_number(sin(a.value.number));
+		if (!is_number(a)) return ERROR_TYPE;
+		*result = make_number(sin(number_value(a)));
 		return ERROR_OK;
 	}
 	else return ERROR_ARGS;
@@ -1641,8 +4260,8 @@ error builtin_sin(struct vector *vargs, atom *result) {
 error builtin_cos(struct vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
-		if (a.type != T_NUM) return ERROR_TYPE;
-		*result = make_number(cos(a.value.number));
+		if (!is_number(a)) return ERROR_TYPE;
+		*result = make_number(cos(number_value(a)));
 		return ERROR_OK;
 	}
 	else return ERROR_ARGS;
@@ -1651,8 +4270,8 @@ error builtin_cos(struct vector *vargs, atom *result) {
 error builtin_tan(struct vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
-		if (a.type != T_NUM) return ERROR_TYPE;
-		*result = make_number(tan(a.value.number));
+		if (!is_number(a)) return ERROR_TYPE;
+		*result = make_number(tan(number_value(a)));
 		return ERROR_OK;
 	}
 	else return ERROR_ARGS;
@@ -1661,8 +4280,8 @@ error builtin_tan(struct vector *vargs, atom *result) {
 error builtin_bound(struct vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
-		if (a.type != T_SYM) return ERROR_TYPE;
-		error err = env_get(env, a.value.symbol, result);
+		if (atom_type(a) != T_SYM) return ERROR_TYPE;
+		error err = env_get(env, atom_symbol(a), result);
 		*result = (err ? nil : sym_t);
 		return ERROR_OK;
 	}
@@ -1672,15 +4291,15 @@ error builtin_bound(struct vector *vargs, atom *result) {
 error builtin_infile(struct vector *vargs, atom *result) {
 	char* mode = "rb";
 	if (vargs->size == 2) {
-		if (vargs->data[1].type != T_SYM) return ERROR_TYPE;
-		if (strcmp(vargs->data[1].value.symbol, "text") == 0) {
+		if (atom_type(vargs->data[1]) != T_SYM) return ERROR_TYPE;
+		if (strcmp(atom_symbol(vargs->data[1]), "text") == 0) {
 			mode = "r";
 		}
 	} else if (vargs->size == 1) {
 	} else return ERROR_ARGS;
 	atom a = vargs->data[0];
-	if (a.type != T_STRING) return ERROR_TYPE;
-	FILE* fp = fopen(a.value.str->value, mode);
+	if (atom_type(a) != T_STRING) return ERROR_TYPE;
+	FILE* fp = port_open(string_value(a), mode, 0);
 	if (!fp) return ERROR_FILE;
 	*result = make_input(fp);
 	return ERROR_OK;
@@ -1695,8 +4314,9 @@ error builtin_outfile(struct vector *vargs, atom *result) {
 	} else if (vargs->size == 1) {
 	} else return ERROR_ARGS;
 	atom a = vargs->data[0];
-	if (a.type != T_STRING) return ERROR_TYPE;
-	FILE* fp = fopen(a.value.str->value, mode);
+	if (atom_type(a) != T_STRING) return ERROR_TYPE;
+	FILE* fp = port_open(string_value(a), mode, 0);
+	if (!fp) return ERROR_FILE;
 	*result = make_output(fp);
 	return ERROR_OK;
 }
@@ -1707,11 +4327,8 @@ error builtin_close(struct vector *vargs, atom *result) {
 		size_t i;
 		for (i = 0; i < vargs->size; i++) {
 			atom a = vargs->data[i];
-			if (a.type != T_INPUT && a.type != T_INPUT_PIPE && a.type != T_OUTPUT) return ERROR_TYPE;
-			if (a.type == T_INPUT_PIPE)
-				pclose(a.value.fp);
-			else
-				fclose(a.value.fp);
+			if (!is_port(a)) return ERROR_TYPE;
+			port_close(atom_port(a));
 		}
 		*result = nil;
 		return ERROR_OK;
@@ -1727,20 +4344,22 @@ error builtin_readb(struct vector *vargs, atom *result) {
 		fp = stdin;
 		break;
 	case 1:
-		fp = vargs->data[0].value.fp;
+		fp = port_fp(vargs->data[0]);
+		if (!fp) return ERROR_TYPE;
 		break;
 	default:
 		return ERROR_ARGS;
 	}
-	*result = make_number(fgetc(fp));
+	*result = make_fixnum(fgetc(fp));
 	return ERROR_OK;
 }
 
 /* sread input-port eof */
 error builtin_sread(struct vector *vargs, atom *result) {
 	if (vargs->size != 2) return ERROR_ARGS;
-	FILE *fp = vargs->data[0].value.fp;
+	FILE *fp = port_fp(vargs->data[0]);
 	atom eof = vargs->data[1];
+	if (!fp) return ERROR_TYPE;
 	error err;
 	if (feof(fp)) {
 		*result = eof;
@@ -1764,15 +4383,17 @@ error builtin_write(struct vector *vargs, atom *result) {
 		fp = stdout;
 		break;
 	case 2:
-		fp = vargs->data[1].value.fp;
+		fp = port_fp(vargs->data[1]);
+		if (!fp) return ERROR_TYPE;
 		break;
 	default:
 		return ERROR_ARGS;
 	}
-	atom a = vargs->data[0];
-	char *s = to_string(a, 1);
-	fprintf(fp, "%s", s);
-	free(s);
+	struct string s;
+	string_new(&s);
+	string_print(&s, vargs->data[0], 1);
+	fwrite(s.str, 1, s.len, fp);
+	free(s.str);
 	*result = nil;
 	return ERROR_OK;
 }
@@ -1780,30 +4401,62 @@ error builtin_write(struct vector *vargs, atom *result) {
 /* newstring length [char] */
 error builtin_newstring(struct vector *vargs, atom *result) {
 	long arg_len = vargs->size;
-	long length = (long)vargs->data[0].value.number;
+	long length = (long)integer_value(vargs->data[0]);
 	char c = 0;
 	char *s;
 	switch (arg_len) {
 	case 1: break;
 	case 2:
-		c = vargs->data[1].value.ch;
+		c = atom_char(vargs->data[1]);
 		break;
 	default:
 		return ERROR_ARGS;
 	}
-	s = malloc((length + 1) * sizeof(char));
-	int i;
-	for (i = 0; i < length; i++)
-		s[i] = c;
+	if (length < 0) return ERROR_ARGS;
+	if (length >= UINT32_MAX || !gc_reserve(length + 1) || !(s = malloc((length + 1) * sizeof(char)))) return ERROR_MEMORY;
+	memset(s, c, length);
 	s[length] = 0; /* end of string */
-	*result = make_string(s);
+	*result = make_string_len(s, length);
+	return ERROR_OK;
+}
+
+/* substring string start [end]
+Returns the characters of string from start to end, or to its end, sharing them with string. */
+error builtin_substring(struct vector *vargs, atom *result) {
+	size_t len, start, end;
+	if (vargs->size != 2 && vargs->size != 3) return ERROR_ARGS;
+	if (atom_type(vargs->data[0]) != T_STRING || !is_number(vargs->data[1])) return ERROR_TYPE;
+	len = atom_str(vargs->data[0])->len;
+	if (integer_value(vargs->data[1]) < 0) return ERROR_ARGS;
+	start = (size_t)integer_value(vargs->data[1]);
+	end = len;
+	if (vargs->size == 3 && !no(vargs->data[2])) {
+		if (!is_number(vargs->data[2])) return ERROR_TYPE;
+		if (integer_value(vargs->data[2]) < 0) return ERROR_ARGS;
+		end = (size_t)integer_value(vargs->data[2]);
+	}
+	if (start > end || end > len) return ERROR_ARGS;
+	*result = make_slice(vargs->data[0], start, end - start);
 	return ERROR_OK;
 }
 
+/* (table ['weak-keys|'weak-values]) */
 error builtin_table(struct vector *vargs, atom *result) {
 	long arg_len = vargs->size;
-	if (arg_len != 0) return ERROR_ARGS;
+	int weak = TABLE_STRONG;
+	if (arg_len > 1) return ERROR_ARGS;
+	if (arg_len == 1) {
+		atom a = vargs->data[0];
+		if (atom_type(a) != T_SYM) return ERROR_TYPE;
+		if (strcmp(atom_symbol(a), "weak-keys") == 0)
+			weak = TABLE_WEAK_KEYS;
+		else if (strcmp(atom_symbol(a), "weak-values") == 0)
+			weak = TABLE_WEAK_VALUES;
+		else
+			return ERROR_TYPE;
+	}
 	*result = make_table(8);
+	atom_table(*result)->weak = weak;
 	return ERROR_OK;
 }
 
@@ -1813,19 +4466,27 @@ error builtin_maptable(struct vector *vargs, atom *result) {
 	if (arg_len != 2) return ERROR_ARGS;
 	atom proc = vargs->data[0];
 	atom tbl = vargs->data[1];
-	if (tbl.type != T_TABLE) return ERROR_TYPE;
+	if (atom_type(tbl) != T_TABLE) return ERROR_TYPE;
+	struct root_frame frame; /* vargs is reused for the arguments of proc */
+	root_frame_push(&frame);
+	frame.atoms[0] = &proc;
+	frame.atoms[1] = &tbl;
 	size_t i;
-	for (i = 0; i < tbl.value.table->capacity; i++) {
-		struct table_entry *p = tbl.value.table->data[i];
+	for (i = 0; i < atom_table(tbl)->capacity; i++) {
+		struct table_entry *p = atom_table(tbl)->data[i];
 		while (p) {
 			vector_clear(vargs);
 			vector_add(vargs, p->k);
 			vector_add(vargs, p->v);
 			error err = apply(proc, vargs, result);
-			if (err) return err;
+			if (err) {
+				root_frame_pop(&frame);
+				return err;
+			}
 			p = p->next;
 		}
 	}
+	root_frame_pop(&frame);
 	*result = tbl;
 	return ERROR_OK;
 }
@@ -1844,18 +4505,16 @@ error builtin_coerce(struct vector *vargs, atom *result) {
 	if (vargs->size != 2) return ERROR_ARGS;
 	obj = vargs->data[0];
 	type = vargs->data[1];
-	switch (obj.type) {
+	switch (atom_type(obj)) {
 	case T_CHAR:
-		if (is(type, sym_int) || is(type, sym_num)) *result = make_number(obj.value.ch);
+		if (is(type, sym_int) || is(type, sym_num)) *result = make_fixnum(atom_char(obj));
 		else if (is(type, sym_string)) {
-			char *buf = malloc(2);
-			buf[0] = obj.value.ch;
-			buf[1] = '\0';
-			*result = make_string(buf);
+			char c = atom_char(obj);
+			*result = make_string_copy(&c, 1);
 		}
 		else if (is(type, sym_sym)) {
 			char buf[2];
-			buf[0] = obj.value.ch;
+			buf[0] = atom_char(obj);
 			buf[1] = '\0';
 			*result = make_sym(buf);
 		}
@@ -1865,8 +4524,8 @@ error builtin_coerce(struct vector *vargs, atom *result) {
 			return ERROR_TYPE;
 		break;
 	case T_NUM:
-		if (is(type, sym_int)) *result = make_number(floor(obj.value.number));
-		else if (is(type, sym_char)) *result = make_char((char)obj.value.number);
+		if (is(type, sym_int)) *result = make_integer(floor(atom_number(obj)));
+		else if (is(type, sym_char)) *result = make_char((char)atom_number(obj));
 		else if (is(type, sym_string)) {
 			*result = make_string(to_string(obj, 0));
 		}
@@ -1875,17 +4534,37 @@ error builtin_coerce(struct vector *vargs, atom *result) {
 		else
 			return ERROR_TYPE;
 		break;
+	case T_FIXNUM:
+		if (is(type, sym_int) || is(type, sym_num)) *result = obj;
+		else if (is(type, sym_char)) *result = make_char((char)atom_fixnum(obj));
+		else if (is(type, sym_string)) {
+			*result = make_string(to_string(obj, 0));
+		}
+		else
+			return ERROR_TYPE;
+		break;
+	case T_BIGNUM:
+		if (is(type, sym_int) || is(type, sym_num)) *result = obj;
+		else if (is(type, sym_string)) {
+			*result = make_string(to_string(obj, 0));
+		}
+		else
+			return ERROR_TYPE;
+		break;
 	case T_STRING:
-		if (is(type, sym_sym)) *result = make_sym(obj.value.str->value);
+		if (is(type, sym_sym)) *result = make_sym(string_value(obj));
 		else if (is(type, sym_cons)) {
+			size_t i;
 			*result = nil;
-			int i;
-			for (i = strlen(obj.value.str->value) - 1; i >= 0; i--) {
-				*result = cons(make_char(obj.value.str->value[i]), *result);
+			for (i = atom_str(obj)->len; i-- > 0;) {
+				*result = cons(make_char(atom_str(obj)->value[i]), *result);
 			}
 		}
-		else if (is(type, sym_num)) *result = make_number(atof(obj.value.str->value));
-		else if (is(type, sym_int)) *result = make_number(atoi(obj.value.str->value));
+		else if (is(type, sym_num)) {
+			char *str = string_value(obj);
+			if (!parse_number(str, str + atom_str(obj)->len, result)) *result = make_number(atof(str));
+		}
+		else if (is(type, sym_int)) *result = string_integer(string_value(obj));
 		else if (is(type, sym_string))
 			*result = obj;
 		else
@@ -1905,9 +4584,9 @@ error builtin_coerce(struct vector *vargs, atom *result) {
 				error err = builtin_coerce(&v, &x);
 				vector_free(&v);
 				if (err) return err;
-				string_cat(&s, x.value.str->value);
+				string_append(&s, atom_str(x)->value, atom_str(x)->len);
 			}
-			*result = make_string(s.str);
+			*result = make_string_len(s.str, s.len);
 		}
 		else if (is(type, sym_cons))
 			*result = obj;
@@ -1916,7 +4595,7 @@ error builtin_coerce(struct vector *vargs, atom *result) {
 		break;
 	case T_SYM:
 		if (is(type, sym_string)) {
-			*result = make_string(strdup(obj.value.symbol));
+			*result = make_string_copy(symbol_name(atom_symbol(obj)), strlen(symbol_name(atom_symbol(obj))));
 		}
 		else if (is(type, sym_sym))
 			*result = obj;
@@ -1948,41 +4627,85 @@ error builtin_err(struct vector *vargs, atom *result) {
 	return ERROR_USER;
 }
 
+/* (dump-heap "file") writes the reachable objects to file, for heapstat. */
+error builtin_dump_heap(struct vector *vargs, atom *result) {
+	if (vargs->size != 1) return ERROR_ARGS;
+	if (atom_type(vargs->data[0]) != T_STRING) return ERROR_TYPE;
+	if (!heap_dump(string_value(vargs->data[0]))) return ERROR_FILE;
+	*result = sym_t;
+	return ERROR_OK;
+}
+
+/* (uniq) returns a new uninterned symbol. */
+error builtin_uniq(struct vector *vargs, atom *result) {
+	if (vargs->size != 0) return ERROR_ARGS;
+	*result = make_uniq();
+	return ERROR_OK;
+}
+
+/* (open-ports) returns the number of ports opened and not closed yet,
+ * including those not collected yet. */
+error builtin_open_ports(struct vector *vargs, atom *result) {
+	if (vargs->size != 0) return ERROR_ARGS;
+	*result = make_fixnum(open_ports);
+	return ERROR_OK;
+}
+
+/* (on-err errfn f) calls f. If it fails, returns (errfn message). */
+error builtin_on_err(struct vector *vargs, atom *result) {
+	if (vargs->size != 2) return ERROR_ARGS;
+	atom errfn = vargs->data[0];
+	struct vector v;
+	vector_new(&v);
+	error err = apply(vargs->data[1], &v, result);
+	if (err) {
+		vector_clear(&v);
+		vector_add(&v, make_string_copy(error_string[err], strlen(error_string[err])));
+		err = apply(errfn, &v, result);
+	}
+	vector_free(&v);
+	return err;
+}
+
 error builtin_len(struct vector *vargs, atom *result) {
 	if (vargs->size != 1) return ERROR_ARGS;
 	atom a = vargs->data[0];
-	if (a.type == T_STRING) {
-		*result = make_number(strlen(a.value.str->value));
+	if (atom_type(a) == T_STRING) {
+		*result = make_fixnum(atom_str(a)->len);
 	}
-	else if (a.type == T_TABLE) {
-		*result = make_number(a.value.table->size);
+	else if (atom_type(a) == T_TABLE) {
+		*result = make_fixnum(atom_table(a)->size);
 	}
 	else {
-		*result = make_number(len(a));
+		*result = make_fixnum(len(a));
 	}
 	return ERROR_OK;
 }
 
 atom make_continuation(jmp_buf *jb) {
-	atom a;
-	a.type = T_CONTINUATION;
-	a.value.jb = jb;
-	return a;
+	return atom_of(T_CONTINUATION, jb, jb);
 }
 
 error builtin_ccc(struct vector *vargs, atom *result) {
 	if (vargs->size != 1) return ERROR_ARGS;
 	atom a = vargs->data[0];
-	if (a.type != T_BUILTIN && a.type != T_CLOSURE) return ERROR_TYPE;
+	if (atom_type(a) != T_BUILTIN && atom_type(a) != T_CLOSURE) return ERROR_TYPE;
 	jmp_buf jb;
+	struct root_frame frame;
+	error err;
+	root_frame_push(&frame);
+	frame.atoms[0] = &a;
 	int val = setjmp(jb);
 	if (val) {
+		root_frame_pop(&frame); /* drop the frames skipped by longjmp */
 		*result = thrown;
 		return ERROR_OK;
 	}
 	vector_clear(vargs);
 	vector_add(vargs, make_continuation(&jb));
-	return apply(a, vargs, result);
+	err = apply(a, vargs, result);
+	root_frame_pop(&frame);
+	return err;
 }
 
 /* pipe-from command
@@ -1991,8 +4714,8 @@ error builtin_ccc(struct vector *vargs, atom *result) {
 error builtin_pipe_from(struct vector* vargs, atom* result) {
 	if (vargs->size != 1) return ERROR_ARGS;
 	atom a = vargs->data[0];
-	if (a.type != T_STRING) return ERROR_TYPE;
-	FILE *fp = popen(vargs->data[0].value.str->value, "r");
+	if (atom_type(a) != T_STRING) return ERROR_TYPE;
+	FILE *fp = port_open(string_value(vargs->data[0]), "r", 1);
 	if (fp == NULL) return ERROR_FILE;
 	*result = make_input_pipe(fp);
 	return ERROR_OK;
@@ -2007,165 +4730,165 @@ void string_new(struct string *dst) {
 	dst->str[0] = 0;
 }
 
-void string_cat(struct string* dst, char* src) {
-	size_t len = dst->len + strlen(src);
-	
-	if (len + 1 > dst->cap) {		
-		while (len + 1 > dst->cap) {
+void string_append(struct string *dst, const char *src, size_t len) {
+	if (dst->len + len + 1 > dst->cap) {
+		while (dst->len + len + 1 > dst->cap) {
 			dst->cap *= 2;
 		}
 		dst->str = realloc(dst->str, dst->cap * sizeof(char));
 	}
-	
-	strcpy(dst->str + dst->len, src);
-	dst->len = len;
+	memcpy(dst->str + dst->len, src, len);
+	dst->len += len;
+	dst->str[dst->len] = 0;
 }
 
-char *to_string(atom a, int write) {
-	struct string s;
-	string_new(&s);
+void string_cat(struct string* dst, char* src) {
+	string_append(dst, src, strlen(src));
+}
 
+/* Appends the printed form of a to s. */
+void string_print(struct string *s, atom a, int write) {
 	char buf[80];
-	switch (a.type) {
+	switch (atom_type(a)) {
 	case T_NIL:
-		string_cat(&s, "nil");
+		string_cat(s, "nil");
 		break;
 	case T_CONS:
 		if (listp(a) && len(a) == 2 && is(car(a), sym_quote)) {
-			string_cat(&s, "'");
-			char *s2 = to_string(car(cdr(a)), write);
-			string_cat(&s, s2);
-			free(s2);
+			string_cat(s, "'");
+			string_print(s, car(cdr(a)), write);
 		}
 		else if (listp(a) && len(a) == 2 && is(car(a), sym_quasiquote)) {
-			string_cat(&s, "`");
-			char *s2 = to_string(car(cdr(a)), write);
-			string_cat(&s, s2);
-			free(s2);
+			string_cat(s, "`");
+			string_print(s, car(cdr(a)), write);
 		}
 		else if (listp(a) && len(a) == 2 && is(car(a), sym_unquote)) {
-			string_cat(&s, ",");
-			char *s2 = to_string(car(cdr(a)), write);
-			string_cat(&s, s2);
-			free(s2);
+			string_cat(s, ",");
+			string_print(s, car(cdr(a)), write);
 		}
 		else if (listp(a) && len(a) == 2 && is(car(a), sym_unquote_splicing)) {
-			string_cat(&s, ",@");
-			char *s2 = to_string(car(cdr(a)), write);
-			string_cat(&s, s2);
-			free(s2);
+			string_cat(s, ",@");
+			string_print(s, car(cdr(a)), write);
 		}
 		else {
-			string_cat(&s, "(");
-			char *s2 = to_string(car(a), write);
-			string_cat(&s, s2);
-			free(s2);
+			string_cat(s, "(");
+			string_print(s, car(a), write);
 			a = cdr(a);
 			while (!no(a)) {
-				if (a.type == T_CONS) {
-					string_cat(&s, " ");
-					s2 = to_string(car(a), write);
-					string_cat(&s, s2);
-					free(s2);
+				if (atom_type(a) == T_CONS) {
+					string_cat(s, " ");
+					string_print(s, car(a), write);
 					a = cdr(a);
 				}
 				else {
-					string_cat(&s, " . ");
-					s2 = to_string(a, write);
-					string_cat(&s, s2);
-					free(s2);
+					string_cat(s, " . ");
+					string_print(s, a, write);
 					break;
 				}
 			}
-			string_cat(&s, ")");
+			string_cat(s, ")");
 		}
 		break;
 	case T_SYM:
-		string_cat(&s, a.value.symbol);
+		string_cat(s, symbol_name(atom_symbol(a)));
 		break;
 	case T_STRING:
-		if (write) string_cat(&s, "\"");
-		string_cat(&s, a.value.str->value);
-		if (write) string_cat(&s, "\"");
+		if (write) string_cat(s, "\"");
+		string_append(s, atom_str(a)->value, atom_str(a)->len);
+		if (write) string_cat(s, "\"");
 		break;
 	case T_NUM:
-		sprintf(buf, "%.16g", a.value.number);
-		string_cat(&s, buf);
+		sprintf(buf, "%.16g", atom_number(a));
+		string_cat(s, buf);
+		break;
+	case T_FIXNUM:
+		sprintf(buf, "%lld", (long long)atom_fixnum(a));
+		string_cat(s, buf);
 		break;
+	case T_BIGNUM: {
+		struct bignum *b = atom_bignum(a);
+		size_t width = b->size * 78 / 8 + 1; /* at least 32 log10(2) digits per digit */
+		char *digits = malloc(width + 2), *p;
+		big_to_decimal(b->digit, b->size, digits + 1, width);
+		digits[width + 1] = 0;
+		for (p = digits + 1; *p == '0'; p++);
+		if (b->sign < 0) *--p = '-';
+		string_cat(s, p);
+		free(digits);
+		break;
+	}
 	case T_BUILTIN:
-		sprintf(buf, "#<builtin:%p>", a.value.builtin);
-		string_cat(&s, buf);
+		sprintf(buf, "#<builtin:%p>", atom_builtin(a));
+		string_cat(s, buf);
 		break;
 	case T_CLOSURE:
 	{
 		atom a2 = cons(sym_fn, cdr(a));
-		char *s2 = to_string(a2, write);
-		string_cat(&s, s2);
-		free(s2);
+		string_print(s, a2, write);
 		break;
 	}
 	case T_MACRO:
-		string_cat(&s, "#<macro:");
-		char *s2 = to_string(cdr(a), write);
-		string_cat(&s, s2);
-		free(s2);
-		string_cat(&s, ">");
+		string_cat(s, "#<macro:");
+		string_print(s, cdr(a), write);
+		string_cat(s, ">");
 		break;
 	case T_INPUT:
-		string_cat(&s, "#<input>");
+		string_cat(s, "#<input>");
 		break;
 	case T_INPUT_PIPE:
-		string_cat(&s, "#<input-pipe>");
+		string_cat(s, "#<input-pipe>");
 		break;
 	case T_OUTPUT:
-		string_cat(&s, "#<output>");
+		string_cat(s, "#<output>");
 		break;
 	case T_TABLE: {
-		string_cat(&s, "#<table:");
+		string_cat(s, "#<table:");
 		size_t i;
-		for (i = 0; i < a.value.table->capacity; i++) {
-			struct table_entry *p = a.value.table->data[i];
+		for (i = 0; i < atom_table(a)->capacity; i++) {
+			struct table_entry *p = atom_table(a)->data[i];
 			while (p) {
-				char *s2 = to_string(p->k, write);
-				string_cat(&s, " ");
-				string_cat(&s, s2);
-				free(s2);
-				string_cat(&s, ":");
-				s2 = to_string(p->v, write);
-				string_cat(&s, s2);
-				free(s2);
+				string_cat(s, " ");
+				string_print(s, p->k, write);
+				string_cat(s, ":");
+				string_print(s, p->v, write);
 				p = p->next;
 			}
 		}
-		string_cat(&s, ">");
+		string_cat(s, ">");
 		break; }
 	case T_CHAR:
 		if (write) {
-			string_cat(&s, "#\\");
-			switch (a.value.ch) {
-			case '\0': string_cat(&s, "nul"); break;
-			case '\r': string_cat(&s, "return"); break;
-			case '\n': string_cat(&s, "newline"); break;
-			case '\t': string_cat(&s, "tab"); break;
-			case ' ': string_cat(&s, "space"); break;
+			string_cat(s, "#\\");
+			switch (atom_char(a)) {
+			case '\0': string_cat(s, "nul"); break;
+			case '\r': string_cat(s, "return"); break;
+			case '\n': string_cat(s, "newline"); break;
+			case '\t': string_cat(s, "tab"); break;
+			case ' ': string_cat(s, "space"); break;
 			default:
-				buf[0] = a.value.ch;
+				buf[0] = atom_char(a);
 				buf[1] = '\0';
-				string_cat(&s, buf);
+				string_cat(s, buf);
 			}
 		}
 		else {
-			s.str[0] = a.value.ch;
-			s.str[1] = '\0';
+			buf[0] = atom_char(a);
+			string_append(s, buf, 1);
 		}
 		break;
 	case T_CONTINUATION:
-		string_cat(&s, "#<continuation>");
+		string_cat(s, "#<continuation>");
 		break;
 	default:
-		string_cat(&s, "#<unknown type>");
+		string_cat(s, "#<unknown type>");
 		break;
 	}
+}
+
+char *to_string(atom a, int write) {
+	struct string s;
+	string_new(&s);
+	string_print(&s, a, write);
 	s.str = realloc(s.str, s.len + 1);
 	return s.str;
 }
@@ -2176,13 +4899,13 @@ size_t hash_code_sym(char *s) {
 
 size_t hash_code(atom a) {
 	size_t r = 1;
-	switch (a.type) {
+	switch (atom_type(a)) {
 	case T_NIL:
 		return 0;
 	case T_CONS:
 		while (!no(a)) {
 			r *= 31;
-			if (a.type == T_CONS) {
+			if (atom_type(a) == T_CONS) {
 				r += hash_code(car(a));
 				a = cdr(a);
 			}
@@ -2193,18 +4916,34 @@ size_t hash_code(atom a) {
 		}
 		return r;
 	case T_SYM:
-		return hash_code_sym(a.value.symbol);
+		return hash_code_sym(atom_symbol(a));
 	case T_STRING: {
-		char *v = a.value.str->value;
-		for (; *v != 0; v++) {
+		char *v = atom_str(a)->value, *end = v + atom_str(a)->len;
+		for (; v < end; v++) {
 			r *= 31;
 			r += *v;
 		}
 		return r; }
-	case T_NUM:
-		return (size_t)((void*)a.value.symbol) + (size_t)a.value.number;
+	case T_NUM: {
+		/* integral doubles hash like the equal fixnum */
+		double x = atom_number(a);
+		uint64_t bits;
+		if (x == floor(x) && x > -9223372036854775808.0 && x < 9223372036854775808.0) return (size_t)(int64_t)x;
+		memcpy(&bits, &x, sizeof(bits));
+		return (size_t)(bits ^ (bits >> 32)); }
+	case T_FIXNUM:
+		return (size_t)atom_fixnum(a);
+	case T_BIGNUM: {
+		/* like the double it equals, if any */
+		struct bignum *b = atom_bignum(a);
+		size_t i;
+		double x = number_value(a);
+		if (bignum_compare_double(a, x) == 0) return hash_code(make_number(x));
+		for (i = 0; i < b->size; i++) r = r * 31 + b->digit[i];
+		return r;
+	}
 	case T_BUILTIN:
-		return (size_t)a.value.builtin;
+		return (size_t)atom_builtin(a);
 	case T_CLOSURE:
 		return hash_code(cdr(a));
 	case T_MACRO:
@@ -2212,35 +4951,29 @@ size_t hash_code(atom a) {
 	case T_INPUT:
 	case T_INPUT_PIPE:
 	case T_OUTPUT:
-		return (size_t)a.value.fp / sizeof(void*); /* discard the lowest bits of the pointer, which are always 0 anyway due to the pointer alignment */
+		return (size_t)atom_port(a) / sizeof(void*); /* discard the lowest bits of the pointer, which are always 0 anyway due to the pointer alignment */
 	default:
 		return 0;
 	}
 }
 
 atom make_table(size_t capacity) {
-	atom a;
-	struct table *s;
-	alloc_count++;
-	s = a.value.table = malloc(sizeof(struct table));
+	struct table *s = slab_alloc(&table_class);
 	s->capacity = capacity;
 	s->size = 0;
+	s->weak = TABLE_STRONG;
 	s->data = malloc(capacity * sizeof(struct table_entry *));
+	gc_account(s, capacity * sizeof(struct table_entry *));
 	size_t i;
 	for (i = 0; i < capacity; i++) {
 		s->data[i] = NULL;
 	}
-	s->mark = 0;
-	s->next = table_head;
-	table_head = s;
-	a.value.table = s;
-	a.type = T_TABLE;
-	stack_add(a);
-	return a;
+	nursery_count++;
+	return atom_of(T_TABLE, table, s);
 }
 
 struct table_entry *table_entry_new(atom k, atom v, struct table_entry *next) {
-	struct table_entry *r = malloc(sizeof(*r));
+	struct table_entry *r = slab_alloc(&entry_class);
 	r->k = k;
 	r->v = v;
 	r->next = next;
@@ -2252,7 +4985,9 @@ struct table_entry *table_entry_new(atom k, atom v, struct table_entry *next) {
 int table_set(struct table *tbl, atom k, atom v) {
 	struct table_entry *p = table_get(tbl, k);
 	if (p) {
+		atom t = atom_of(T_TABLE, table, tbl);
 		p->v = v;
+		gc_write_barrier(t);
 		return 1;
 	}
 	else {
@@ -2265,17 +5000,21 @@ int table_set(struct table *tbl, atom k, atom v) {
 int table_set_sym(struct table *tbl, char *k, atom v) {
 	struct table_entry *p = table_get_sym(tbl, k);
 	if (p) {
+		atom t = atom_of(T_TABLE, table, tbl);
 		p->v = v;
+		gc_write_barrier(t);
 		return 1;
 	}
 	else {
-		atom s = { T_SYM,.value.symbol = k };
+		atom s = atom_of(T_SYM, symbol, k);
 		table_add(tbl, s, v);
 		return 0;
 	}
 }
 
 void table_add(struct table *tbl, atom k, atom v) {
+	atom t = atom_of(T_TABLE, table, tbl);
+	gc_write_barrier(t);
 	if (tbl->size + 1 > tbl->capacity) { /* rehash, load factor = 1 */
 		size_t new_capacity = (tbl->size + 1) * 2;
 		struct table_entry **data2 = malloc(new_capacity * sizeof(struct table_entry *));
@@ -2288,12 +5027,13 @@ void table_add(struct table *tbl, atom k, atom v) {
 			while (p) {
 				struct table_entry **p2 = &data2[hash_code(p->k) % new_capacity];
 				struct table_entry *next = p->next;
-				*p2 = table_entry_new(p->k, p->v, *p2);
-				free(p);
+				p->next = *p2;
+				*p2 = p;
 				p = next;
 			}
 		}
 		free(tbl->data);
+		gc_account(tbl, (new_capacity - tbl->capacity) * sizeof(struct table_entry *));
 		tbl->data = data2;
 		tbl->capacity = new_capacity;
 	}
@@ -2301,6 +5041,7 @@ void table_add(struct table *tbl, atom k, atom v) {
 	struct table_entry **p = &tbl->data[hash_code(k) % tbl->capacity];
 	*p = table_entry_new(k, v, *p);
 	tbl->size++;
+	gc_account(tbl, sizeof(struct table_entry));
 }
 
 /* return entry. return NULL if not found */
@@ -2323,7 +5064,7 @@ struct table_entry *table_get_sym(struct table *tbl, char *k) {
 	size_t pos = hash_code_sym(k) % tbl->capacity;
 	struct table_entry *p = tbl->data[pos];
 	while (p) {
-		if (p->k.value.symbol == k) {
+		if (atom_symbol(p->k) == k) {
 			return p;
 		}
 		p = p->next;
@@ -2362,20 +5103,22 @@ char *slurp(const char *path)
 	return r;
 }
 
-/* compile-time macro */
-error macex(atom expr, atom *result) {
+/* compile-time macro. Its locals are rooted in frame. */
+error macex_frame(struct root_frame *frame, atom expr, atom *result) {
 	error err = ERROR_OK;
+	atom expr2 = nil;
+	frame->atoms[0] = &expr;
+	frame->atoms[1] = &expr2;
 
-	if (expr.type != T_CONS || !listp(expr)) {
+	if (atom_type(expr) != T_CONS || !listp(expr)) {
 		*result = expr;
 		return ERROR_OK;
 	}
 	else {
-		int ss = stack_size; /* save stack point */
 		atom op = car(expr);
 
 		/* Handle quote */
-		if (op.type == T_SYM && op.value.symbol == sym_quote.value.symbol) {
+		if (atom_type(op) == T_SYM && atom_symbol(op) == atom_symbol(sym_quote)) {
 			*result = expr;
 			return ERROR_OK;
 		}
@@ -2383,11 +5126,11 @@ error macex(atom expr, atom *result) {
 		atom args = cdr(expr);
 
 		/* Is it a macro? */
-		if (op.type == T_SYM && !env_get(env, op.value.symbol, result) && result->type == T_MACRO) {
+		if (atom_type(op) == T_SYM && !env_get(env, atom_symbol(op), result) && atom_type(*result) == T_MACRO) {
 			/* Evaluate operator */
 			op = *result;
 
-			op.type = T_CLOSURE;
+			op = atom_of(T_CLOSURE, pair, atom_pair(op));
 
 			atom result2;
 			struct vector vargs;
@@ -2395,37 +5138,46 @@ error macex(atom expr, atom *result) {
 			err = apply(op, &vargs, &result2);
 			if (err) {
 				vector_free(&vargs);
-				stack_restore(ss);
 				return err;
 			}
 			err = macex(result2, result); /* recursive */
 			if (err) {
 				vector_free(&vargs);
-				stack_restore(ss);
 				return err;
 			}
 			vector_free(&vargs);
-			stack_restore_add(ss, *result);
 			return ERROR_OK;
 		}
 		else {
 			/* macex elements */
-			atom expr2 = copy_list(expr);
+			expr2 = copy_list(expr);
 			atom h;
 			for (h = expr2; !no(h); h = cdr(h)) {
 				err = macex(car(h), &car(h));
 				if (err) {
-					stack_restore(ss);
 					return err;
 				}
+				gc_write_barrier(h); /* expansion may have promoted expr2 */
 			}
 			*result = expr2;
-			stack_restore_add(ss, *result);
 			return ERROR_OK;
 		}
 	}
 }
 
+error macex(atom expr, atom *result) {
+	struct root_frame frame;
+	error err;
+	if (atom_type(expr) != T_CONS) {
+		*result = expr;
+		return ERROR_OK;
+	}
+	root_frame_push(&frame);
+	err = macex_frame(&frame, expr, result);
+	root_frame_pop(&frame);
+	return err;
+}
+
 error macex_eval(atom expr, atom *result) {
 	atom expr2;
 	error err = macex(expr, &expr2);
@@ -2443,7 +5195,10 @@ error macex_eval(atom expr, atom *result) {
 error load_string(const char *text) {
 	error err = ERROR_OK;
 	const char *p = text;
-	atom expr;
+	atom expr = nil;
+	struct root_frame frame; /* expr is printed after an error */
+	root_frame_push(&frame);
+	frame.atoms[0] = &expr;
 	while (*p) {
 		if (isspace((int)*p)) {
 			p++;
@@ -2471,6 +5226,7 @@ error load_string(const char *text) {
 		}*/
 	}
 	/*puts("");*/
+	root_frame_pop(&frame);
 	return err;
 }
 
@@ -2490,20 +5246,28 @@ error arc_load_file(const char *path)
 	}
 }
 
-error eval_expr(atom expr, atom env, atom *result)
+/* Evaluates expr with its locals rooted in frame. */
+error eval_expr_frame(struct root_frame *frame, atom expr, atom env, atom *result)
 {
 	error err;
-	int ss = stack_size; /* save stack point */
+	atom fn = nil;
+	struct vector vargs;
+	frame->atoms[0] = &expr;
+	frame->atoms[1] = &env;
+	frame->atoms[2] = &fn;
 start_eval:
-	stack_add(expr);
-	stack_add(env);
 	consider_gc();
-	if (expr.type == T_SYM) {
-		err = env_get(env, expr.value.symbol, result);
+	if (heap_dump_requested) heap_dump_on_request();
+	if (heap_bytes > heap_limit && !gc_reserve(0)) {
+		err_expr = expr;
+		return ERROR_MEMORY;
+	}
+	if (atom_type(expr) == T_SYM) {
+		err = env_get(env, atom_symbol(expr), result);
 		err_expr = expr;
 		return err;
 	}
-	else if (expr.type != T_CONS) {
+	else if (atom_type(expr) != T_CONS) {
 		*result = expr;
 		return ERROR_OK;
 	}
@@ -2511,9 +5275,9 @@ start_eval:
 		atom op = car(expr);
 		atom args = cdr(expr);
 
-		if (op.type == T_SYM) {
+		if (atom_type(op) == T_SYM) {
 			/* Handle special forms */
-			if (op.value.symbol == sym_if.value.symbol) {
+			if (atom_symbol(op) == atom_symbol(sym_if)) {
 				atom *p = &args;
 				while (!no(*p)) {
 					atom cond;
@@ -2524,7 +5288,6 @@ start_eval:
 					}
 					err = eval_expr(car(*p), env, &cond);
 					if (err) {
-						stack_restore(ss);
 						return err;
 					}
 					if (!no(cond)) { /* then */
@@ -2535,61 +5298,51 @@ start_eval:
 					p = &cdr(cdr(*p));
 				}
 				*result = nil;
-				stack_restore_add(ss, *result);
 				return ERROR_OK;
 			}
-			else if (op.value.symbol == sym_assign.value.symbol) {
+			else if (atom_symbol(op) == atom_symbol(sym_assign)) {
 				atom sym;
 				if (no(args) || no(cdr(args))) {
-					stack_restore(ss);
 					return ERROR_ARGS;
 				}
 
 				sym = car(args);
-				if (sym.type == T_SYM) {
+				if (atom_type(sym) == T_SYM) {
 					atom val;
 					err = eval_expr(car(cdr(args)), env, &val);
 					if (err) {
-						stack_restore(ss);
 						return err;
 					}
 
 					*result = val;
-					err = env_assign_eq(env, sym.value.symbol, val);
-					stack_restore_add(ss, *result);
+					err = env_assign_eq(env, atom_symbol(sym), val);
 					return err;
 				}
 				else {
-					stack_restore(ss);
 					return ERROR_TYPE;
 				}
 			}
-			else if (op.value.symbol == sym_quote.value.symbol) {
+			else if (atom_symbol(op) == atom_symbol(sym_quote)) {
 				if (no(args) || !no(cdr(args))) {
-					stack_restore(ss);
 					return ERROR_ARGS;
 				}
 
 				*result = car(args);
-				stack_restore_add(ss, *result);
 				return ERROR_OK;
 			}
-			else if (op.value.symbol == sym_fn.value.symbol) {
+			else if (atom_symbol(op) == atom_symbol(sym_fn)) {
 				if (no(args)) {
-					stack_restore(ss);
 					return ERROR_ARGS;
 				}
 				err = make_closure(env, car(args), cdr(args), result);
-				stack_restore_add(ss, *result);
 				return err;
 			}
-			else if (op.value.symbol == sym_do.value.symbol) {
+			else if (atom_symbol(op) == atom_symbol(sym_do)) {
 				/* Evaluate the body */
 				while (!no(args)) {
 					if (no(cdr(args))) {
 						/* tail call */
 						expr = car(args);
-						stack_restore(ss);
 						goto start_eval;
 					}
 					error err = eval_expr(car(args), env, result);
@@ -2601,53 +5354,46 @@ start_eval:
 				*result = nil;
 				return ERROR_OK;
 			}
-			else if (op.value.symbol == sym_mac.value.symbol) { /* (mac name (arg ...) body) */
+			else if (atom_symbol(op) == atom_symbol(sym_mac)) { /* (mac name (arg ...) body) */
 				atom name, macro;
 
 				if (no(args) || no(cdr(args)) || no(cdr(cdr(args)))) {
-					stack_restore(ss);
 					return ERROR_ARGS;
 				}
 
 				name = car(args);
-				if (name.type != T_SYM) {
-					stack_restore(ss);
+				if (atom_type(name) != T_SYM) {
 					return ERROR_TYPE;
 				}
 
 				err = make_closure(env, car(cdr(args)), cdr(cdr(args)), &macro);
 				if (!err) {
-					macro.type = T_MACRO;
+					macro = atom_of(T_MACRO, pair, atom_pair(macro));
 					*result = name;
-					err = env_assign(env, name.value.symbol, macro);
-					stack_restore_add(ss, *result);
+					err = env_assign(env, atom_symbol(name), macro);
 					return err;
 				}
 				else {
-					stack_restore(ss);
 					return err;
 				}
 			}
 		}
 
 		/* Evaluate operator */
-		atom fn;
 		err = eval_expr(op, env, &fn);
 		if (err) {
-			stack_restore(ss);
 			return err;
 		}
 
 		/* Evaulate arguments */
-		struct vector vargs;
 		vector_new(&vargs);
+		frame->vector = &vargs;
 		atom *p = &args;
 		while (!no(*p)) {
 			atom r;
 			err = eval_expr(car(*p), env, &r);
 			if (err) {
 				vector_free(&vargs);
-				stack_restore(ss);
 				return err;
 			}
 			vector_add(&vargs, r);
@@ -2655,8 +5401,9 @@ start_eval:
 		}
 
 		/* tail call optimization of err = apply(fn, args, result); */
-		if (fn.type == T_CLOSURE) {
+		if (atom_type(fn) == T_CLOSURE) {
 			atom arg_names = car(cdr(fn));
+			if (heap_profile) heap_profile_enter(op, fn);
 			env = env_create(car(fn));
 			expr = cdr(cdr(fn));
 
@@ -2666,27 +5413,135 @@ start_eval:
 				return err;
 			}
 			vector_free(&vargs);
-			stack_restore(ss);
+			frame->vector = NULL;
 			goto start_eval;
 		}
 		else {
 			err = apply(fn, &vargs, result);
 			vector_free(&vargs);
 		}
-		stack_restore_add(ss, *result);
 		return err;
 	}
 }
 
+error eval_expr(atom expr, atom env, atom *result)
+{
+	struct root_frame frame;
+	error err;
+	uint32_t site = heap_site; /* a called closure may change it */
+	root_frame_push(&frame);
+	err = eval_expr_frame(&frame, expr, env, result);
+	root_frame_pop(&frame);
+	heap_site = site;
+	return err;
+}
+
+/* Parses a byte count with an optional K, M or G suffix. */
+int parse_size(const char *s, size_t *result)
+{
+	char *end;
+	double x = strtod(s, &end);
+	switch (toupper((unsigned char)*end)) {
+	case 'G': x *= 1024; /* fall through */
+	case 'M': x *= 1024; /* fall through */
+	case 'K': x *= 1024;
+		end++;
+	}
+	if (*end || end == s || !(x >= 0) || x > (double)((size_t)-1 / 2)) return 0;
+	*result = (size_t)x;
+	return 1;
+}
+
+/* Sets a collector option given as "name=value". Returns 0 if the option is
+ * unknown or the value is invalid. */
+int gc_option(const char *opt)
+{
+	const char *value = strchr(opt, '=');
+	size_t len;
+	char *end;
+	if (!value) return 0;
+	len = value - opt;
+	value++;
+	if (len == 4 && strncmp(opt, "mode", len) == 0) {
+		gc_incremental = gc_compacting = 0;
+		if (strcmp(value, "incremental") == 0)
+			gc_incremental = 1;
+		else if (strcmp(value, "compacting") == 0)
+			gc_compacting = 1;
+		else if (strcmp(value, "generational") != 0)
+			return 0;
+	}
+	else if (len == 7 && strncmp(opt, "threads", len) == 0) {
+		long n = strtol(value, &end, 10);
+		if (*end || n <= 0 || n > 1024) return 0;
+		gc_threads = n;
+	}
+	else if (len == 12 && strncmp(opt, "heap-profile", len) == 0) {
+		if (!*value) return 0;
+		free(heap_profile);
+		heap_profile = strdup(value);
+		if (!heap_site_count) heap_site_of("(top level)");
+	}
+	else if (len == 10 && strncmp(opt, "huge-pages", len) == 0) {
+		if (strcmp(value, "on") == 0)
+			gc_huge_pages = 1;
+		else if (strcmp(value, "off") == 0)
+			gc_huge_pages = 0;
+		else
+			return 0;
+	}
+	else if (len == 5 && strncmp(opt, "sweep", len) == 0) {
+		if (strcmp(value, "background") == 0)
+			gc_background_sweep = 1;
+		else if (strcmp(value, "lazy") == 0)
+			gc_background_sweep = 0;
+		else
+			return 0;
+	}
+	else if (len == 6 && strncmp(opt, "budget", len) == 0) {
+		long n = strtol(value, &end, 10);
+		if (*end || n <= 0) return 0;
+		gc_budget = n;
+	}
+	else if (len == 5 && strncmp(opt, "pause", len) == 0) {
+		long n = strtol(value, &end, 10);
+		if (*end || n < 0) return 0;
+		gc_pause = n;
+	}
+	else if (len == 6 && strncmp(opt, "growth", len) == 0) {
+		double x = strtod(value, &end);
+		if (*end || !(x >= 1)) return 0;
+		gc_growth = x;
+	}
+	else if (len == 8 && strncmp(opt, "min-heap", len) == 0) {
+		if (!parse_size(value, &gc_min_heap)) return 0;
+	}
+	else if (len == 8 && strncmp(opt, "max-heap", len) == 0) {
+		if (!parse_size(value, &gc_max_heap)) return 0;
+		if (gc_max_heap == 0) gc_max_heap = (size_t)-1;
+		heap_limit = gc_max_heap;
+	}
+	else {
+		return 0;
+	}
+	return 1;
+}
+
 void arc_init(char *file_path) {
+	size_t i;
 #ifdef READLINE
 	rl_bind_key('\t', rl_insert); /* prevent tab completion */
 #endif
 	srand((unsigned int)time(0));
+	gc_set_threshold();
+#ifdef SIGUSR1
+	signal(SIGUSR1, heap_dump_signal);
+#endif
 	env = env_create_cap(nil, 500);
+	err_expr = nil;
+	thrown = nil;
 
-	symbol_capacity = 500;
-	symbol_table = malloc(symbol_capacity * sizeof(char *));
+	symbol_rehash(NULL, 0, SYMBOL_MIN_CAPACITY);
 
 	/* Set up the initial environment */
 	sym_t = make_sym("t");
@@ -2709,64 +5564,72 @@ void arc_init(char *file_path) {
 	sym_int = make_sym("int");
 	sym_char = make_sym("char");
 	sym_do = make_sym("do");
+	for (i = 0; i < symbol_capacity; i++) {
+		if (symbol_table[i]) symbol_table[i]->permanent = 1;
+	}
 
-	env_assign(env, sym_t.value.symbol, sym_t);
-	env_assign(env, make_sym("nil").value.symbol, nil);
-	env_assign(env, make_sym("car").value.symbol, make_builtin(builtin_car));
-	env_assign(env, make_sym("cdr").value.symbol, make_builtin(builtin_cdr));
-	env_assign(env, make_sym("cons").value.symbol, make_builtin(builtin_cons));
-	env_assign(env, make_sym("+").value.symbol, make_builtin(builtin_add));
-	env_assign(env, make_sym("-").value.symbol, make_builtin(builtin_subtract));
-	env_assign(env, make_sym("*").value.symbol, make_builtin(builtin_multiply));
-	env_assign(env, make_sym("/").value.symbol, make_builtin(builtin_divide));
-	env_assign(env, make_sym("<").value.symbol, make_builtin(builtin_less));
-	env_assign(env, make_sym(">").value.symbol, make_builtin(builtin_greater));
-	env_assign(env, make_sym("apply").value.symbol, make_builtin(builtin_apply));
-	env_assign(env, make_sym("is").value.symbol, make_builtin(builtin_is));
-	env_assign(env, make_sym("scar").value.symbol, make_builtin(builtin_scar));
-	env_assign(env, make_sym("scdr").value.symbol, make_builtin(builtin_scdr));
-	env_assign(env, make_sym("mod").value.symbol, make_builtin(builtin_mod));
-	env_assign(env, make_sym("type").value.symbol, make_builtin(builtin_type));
-	env_assign(env, make_sym("sref").value.symbol, make_builtin(builtin_sref));
-	env_assign(env, make_sym("writeb").value.symbol, make_builtin(builtin_writeb));
-	env_assign(env, make_sym("expt").value.symbol, make_builtin(builtin_expt));
-	env_assign(env, make_sym("log").value.symbol, make_builtin(builtin_log));
-	env_assign(env, make_sym("sqrt").value.symbol, make_builtin(builtin_sqrt));
-	env_assign(env, make_sym("readline").value.symbol, make_builtin(builtin_readline));
-	env_assign(env, make_sym("quit").value.symbol, make_builtin(builtin_quit));
-	env_assign(env, make_sym("rand").value.symbol, make_builtin(builtin_rand));
-	env_assign(env, make_sym("read").value.symbol, make_builtin(builtin_read));
-	env_assign(env, make_sym("macex").value.symbol, make_builtin(builtin_macex));
-	env_assign(env, make_sym("string").value.symbol, make_builtin(builtin_string));
-	env_assign(env, make_sym("sym").value.symbol, make_builtin(builtin_sym));
-	env_assign(env, make_sym("system").value.symbol, make_builtin(builtin_system));
-	env_assign(env, make_sym("eval").value.symbol, make_builtin(builtin_eval));
-	env_assign(env, make_sym("load").value.symbol, make_builtin(builtin_load));
-	env_assign(env, make_sym("int").value.symbol, make_builtin(builtin_int));
-	env_assign(env, make_sym("trunc").value.symbol, make_builtin(builtin_trunc));
-	env_assign(env, make_sym("sin").value.symbol, make_builtin(builtin_sin));
-	env_assign(env, make_sym("cos").value.symbol, make_builtin(builtin_cos));
-	env_assign(env, make_sym("tan").value.symbol, make_builtin(builtin_tan));
-	env_assign(env, make_sym("bound").value.symbol, make_builtin(builtin_bound));
-	env_assign(env, make_sym("infile").value.symbol, make_builtin(builtin_infile));
-	env_assign(env, make_sym("outfile").value.symbol, make_builtin(builtin_outfile));
-	env_assign(env, make_sym("close").value.symbol, make_builtin(builtin_close));
-	env_assign(env, make_sym("stdin").value.symbol, make_input(stdin));
-	env_assign(env, make_sym("stdout").value.symbol, make_output(stdout));
-	env_assign(env, make_sym("stderr").value.symbol, make_output(stderr));
-	env_assign(env, make_sym("disp").value.symbol, make_builtin(builtin_disp));
-	env_assign(env, make_sym("readb").value.symbol, make_builtin(builtin_readb));
-	env_assign(env, make_sym("sread").value.symbol, make_builtin(builtin_sread));
-	env_assign(env, make_sym("write").value.symbol, make_builtin(builtin_write));
-	env_assign(env, make_sym("newstring").value.symbol, make_builtin(builtin_newstring));
-	env_assign(env, make_sym("table").value.symbol, make_builtin(builtin_table));
-	env_assign(env, make_sym("maptable").value.symbol, make_builtin(builtin_maptable));
-	env_assign(env, make_sym("coerce").value.symbol, make_builtin(builtin_coerce));
-	env_assign(env, make_sym("flushout").value.symbol, make_builtin(builtin_flushout));
-	env_assign(env, make_sym("err").value.symbol, make_builtin(builtin_err));
-	env_assign(env, make_sym("len").value.symbol, make_builtin(builtin_len));
-	env_assign(env, make_sym("ccc").value.symbol, make_builtin(builtin_ccc));
-	env_assign(env, make_sym("pipe-from").value.symbol, make_builtin(builtin_pipe_from));
+	env_assign(env, atom_symbol(sym_t), sym_t);
+	env_assign(env, atom_symbol(make_sym("nil")), nil);
+	env_assign(env, atom_symbol(make_sym("car")), make_builtin(builtin_car));
+	env_assign(env, atom_symbol(make_sym("cdr")), make_builtin(builtin_cdr));
+	env_assign(env, atom_symbol(make_sym("cons")), make_builtin(builtin_cons));
+	env_assign(env, atom_symbol(make_sym("+")), make_builtin(builtin_add));
+	env_assign(env, atom_symbol(make_sym("-")), make_builtin(builtin_subtract));
+	env_assign(env, atom_symbol(make_sym("*")), make_builtin(builtin_multiply));
+	env_assign(env, atom_symbol(make_sym("/")), make_builtin(builtin_divide));
+	env_assign(env, atom_symbol(make_sym("<")), make_builtin(builtin_less));
+	env_assign(env, atom_symbol(make_sym(">")), make_builtin(builtin_greater));
+	env_assign(env, atom_symbol(make_sym("apply")), make_builtin(builtin_apply));
+	env_assign(env, atom_symbol(make_sym("is")), make_builtin(builtin_is));
+	env_assign(env, atom_symbol(make_sym("scar")), make_builtin(builtin_scar));
+	env_assign(env, atom_symbol(make_sym("scdr")), make_builtin(builtin_scdr));
+	env_assign(env, atom_symbol(make_sym("mod")), make_builtin(builtin_mod));
+	env_assign(env, atom_symbol(make_sym("type")), make_builtin(builtin_type));
+	env_assign(env, atom_symbol(make_sym("sref")), make_builtin(builtin_sref));
+	env_assign(env, atom_symbol(make_sym("writeb")), make_builtin(builtin_writeb));
+	env_assign(env, atom_symbol(make_sym("expt")), make_builtin(builtin_expt));
+	env_assign(env, atom_symbol(make_sym("log")), make_builtin(builtin_log));
+	env_assign(env, atom_symbol(make_sym("sqrt")), make_builtin(builtin_sqrt));
+	env_assign(env, atom_symbol(make_sym("readline")), make_builtin(builtin_readline));
+	env_assign(env, atom_symbol(make_sym("quit")), make_builtin(builtin_quit));
+	env_assign(env, atom_symbol(make_sym("rand")), make_builtin(builtin_rand));
+	env_assign(env, atom_symbol(make_sym("read")), make_builtin(builtin_read));
+	env_assign(env, atom_symbol(make_sym("macex")), make_builtin(builtin_macex));
+	env_assign(env, atom_symbol(make_sym("string")), make_builtin(builtin_string));
+	env_assign(env, atom_symbol(make_sym("sym")), make_builtin(builtin_sym));
+	env_assign(env, atom_symbol(make_sym("system")), make_builtin(builtin_system));
+	env_assign(env, atom_symbol(make_sym("eval")), make_builtin(builtin_eval));
+	env_assign(env, atom_symbol(make_sym("load")), make_builtin(builtin_load));
+	env_assign(env, atom_symbol(make_sym("int")), make_builtin(builtin_int));
+	env_assign(env, atom_symbol(make_sym("trunc")), make_builtin(builtin_trunc));
+	env_assign(env, atom_symbol(make_sym("sin")), make_builtin(builtin_sin));
+	env_assign(env, atom_symbol(make_sym("cos")), make_builtin(builtin_cos));
+	env_assign(env, atom_symbol(make_sym("tan")), make_builtin(builtin_tan));
+	env_assign(env, atom_symbol(make_sym("bound")), make_builtin(builtin_bound));
+	env_assign(env, atom_symbol(make_sym("infile")), make_builtin(builtin_infile));
+	env_assign(env, atom_symbol(make_sym("outfile")), make_builtin(builtin_outfile));
+	env_assign(env, atom_symbol(make_sym("close")), make_builtin(builtin_close));
+	env_assign(env, atom_symbol(make_sym("stdin")), make_input(stdin));
+	env_assign(env, atom_symbol(make_sym("stdout")), make_output(stdout));
+	env_assign(env, atom_symbol(make_sym("stderr")), make_output(stderr));
+	env_assign(env, atom_symbol(make_sym("disp")), make_builtin(builtin_disp));
+	env_assign(env, atom_symbol(make_sym("readb")), make_builtin(builtin_readb));
+	env_assign(env, atom_symbol(make_sym("sread")), make_builtin(builtin_sread));
+	env_assign(env, atom_symbol(make_sym("write")), make_builtin(builtin_write));
+	env_assign(env, atom_symbol(make_sym("newstring")), make_builtin(builtin_newstring));
+	env_assign(env, atom_symbol(make_sym("substring")), make_builtin(builtin_substring));
+	env_assign(env, atom_symbol(make_sym("table")), make_builtin(builtin_table));
+	env_assign(env, atom_symbol(make_sym("maptable")), make_builtin(builtin_maptable));
+	env_assign(env, atom_symbol(make_sym("coerce")), make_builtin(builtin_coerce));
+	env_assign(env, atom_symbol(make_sym("flushout")), make_builtin(builtin_flushout));
+	env_assign(env, atom_symbol(make_sym("err")), make_builtin(builtin_err));
+	env_assign(env, atom_symbol(make_sym("on-err")), make_builtin(builtin_on_err));
+	env_assign(env, atom_symbol(make_sym("dump-heap")), make_builtin(builtin_dump_heap));
+	env_assign(env, atom_symbol(make_sym("open-ports")), make_builtin(builtin_open_ports));
+	env_assign(env, atom_symbol(make_sym("uniq")), make_builtin(builtin_uniq));
+	env_assign(env, atom_symbol(make_sym("len")), make_builtin(builtin_len));
+	env_assign(env, atom_symbol(make_sym("ccc")), make_builtin(builtin_ccc));
+	env_assign(env, atom_symbol(make_sym("pipe-from")), make_builtin(builtin_pipe_from));
 
 #include "library.h"
 
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <math.h>
 #include <time.h>
 #include <setjmp.h>
@@ -19,6 +20,39 @@
 #include <readline/history.h>
 #endif
 
+#ifdef __GNUC__
+#define prefetch(p) __builtin_prefetch(p)
+#define gc_no_sanitize __attribute__((no_sanitize_address))
+#define ctz64(x) __builtin_ctzll(x)
+#define popcount64(x) __builtin_popcountll(x)
+#else
+#include <intrin.h>
+#define prefetch(p)
+#define gc_no_sanitize
+static __inline int ctz64(uint64_t x) { unsigned long i; _BitScanForward64(&i, x); return (int)i; }
+#define popcount64(x) ((int)__popcnt64(x))
+#endif
+
+/* the collector threads need POSIX threads and GCC atomics */
+#if defined(__GNUC__) && !defined(_WIN32)
+#define GC_PARALLEL
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/* slabs are carved from arenas mapped from the OS */
+#ifndef _WIN32
+#define GC_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <signal.h>
+#ifdef SIGUSR1
+#include <unistd.h>
+#endif
+
 #ifdef _MSC_VER
 #define strdup _strdup
 #define popen _popen
@@ -39,17 +73,61 @@ enum type {
 	T_OUTPUT,
 	T_TABLE,
 	T_CHAR,
-	T_CONTINUATION
+	T_CONTINUATION,
+	T_FIXNUM, /* exact integer */
+	T_BIGNUM /* exact integer outside the fixnum range */
 };
 
 typedef enum {
-  ERROR_OK = 0, ERROR_SYNTAX, ERROR_UNBOUND, ERROR_ARGS, ERROR_TYPE, ERROR_FILE, ERROR_USER
+  ERROR_OK = 0, ERROR_SYNTAX, ERROR_UNBOUND, ERROR_ARGS, ERROR_TYPE, ERROR_FILE, ERROR_USER, ERROR_MEMORY
 } error;
 
+#ifdef NANBOX
+/* An atom is a double, or else a NaN with the sign and exponent bits set,
+   the type in the next four bits and a pointer or char in the low 48 bits.
+   Pointers must fit in 48 bits. nil takes the tag of T_NUM, which needs
+   none. */
+typedef uint64_t atom;
+#else
 typedef struct atom atom;
+#endif
 struct vector;
 typedef error(*builtin)(struct vector *vargs, atom *result);
 
+#ifdef NANBOX
+#define NANBOX_TAGGED 0xfff0000000000000ULL
+#define NANBOX_PAYLOAD 0x0000ffffffffffffULL
+#define nanbox_tag(t) ((uint64_t)((t) == T_NIL ? T_NUM : (t)) << 48)
+#define NANBOX_NIL (NANBOX_TAGGED | nanbox_tag(T_NIL))
+#define atom_of(t, field, x) ((atom)(NANBOX_TAGGED | nanbox_tag(t) | (uint64_t)(uintptr_t)(x)))
+static inline enum type atom_type(atom a)
+{
+	unsigned tag = (unsigned)(a >> 48);
+	if (tag <= 0xfff0) return T_NUM; /* -inf is 0xfff0 */
+	tag &= 15;
+	return tag == T_NUM ? T_NIL : (enum type)tag;
+}
+static inline double atom_number(atom a)
+{
+	double x;
+	memcpy(&x, &a, sizeof(x));
+	return x;
+}
+#define atom_pointer(a) ((uintptr_t)((a) & NANBOX_PAYLOAD))
+#define atom_pair(a) ((struct pair *)atom_pointer(a))
+#define atom_symbol(a) ((char *)atom_pointer(a))
+#define atom_str(a) ((struct str *)atom_pointer(a))
+#define atom_builtin(a) ((builtin)atom_pointer(a))
+#define atom_port(a) ((struct port *)atom_pointer(a))
+#define atom_table(a) ((struct table *)atom_pointer(a))
+#define atom_char(a) ((char)(a))
+#define atom_jb(a) ((jmp_buf *)atom_pointer(a))
+#define atom_bignum(a) ((struct bignum *)atom_pointer(a))
+#define atom_fixnum(a) ((int64_t)((a) << 16) >> 16)
+#define FIXNUM_MIN (-((int64_t)1 << 47))
+#define FIXNUM_MAX (((int64_t)1 << 47) - 1)
+#define no(a) ((a) == NANBOX_NIL)
+#else
 struct atom {
 	enum type type;
 
@@ -59,13 +137,33 @@ struct atom {
 		char *symbol;
 		struct str *str;
 		builtin builtin;
-		FILE *fp;
+		struct port *port;
 		struct table *table;
 		char ch;
 		jmp_buf *jb;
+		int64_t fixnum;
+		struct bignum *bignum;
 	} value;
 };
 
+#define atom_of(t, field, x) ((atom){ (t), { .field = (x) } })
+#define atom_type(a) ((a).type)
+#define atom_number(a) ((a).value.number)
+#define atom_pair(a) ((a).value.pair)
+#define atom_symbol(a) ((a).value.symbol)
+#define atom_str(a) ((a).value.str)
+#define atom_builtin(a) ((a).value.builtin)
+#define atom_port(a) ((a).value.port)
+#define atom_table(a) ((a).value.table)
+#define atom_char(a) ((a).value.ch)
+#define atom_jb(a) ((a).value.jb)
+#define atom_fixnum(a) ((a).value.fixnum)
+#define atom_bignum(a) ((a).value.bignum)
+#define FIXNUM_MIN INT64_MIN
+#define FIXNUM_MAX INT64_MAX
+#define no(a) ((a).type == T_NIL)
+#endif
+
 struct vector {
 	atom *data;
 	atom static_data[8]; /* small size optimization */
@@ -73,28 +171,155 @@ struct vector {
 };
 
 struct pair {
-	struct atom car, cdr;
-	char mark;
-	struct pair *next;
+	atom car, cdr;
 };
 
+/* The stream of an input or output port. It is closed when the port is
+   collected, except for the standard streams. */
+struct port {
+	FILE *fp; /* NULL once closed */
+	char pipe; /* closed with pclose */
+	char owned; /* closed by the collector, counted in open_ports */
+};
+#define is_integer(a) (atom_type(a) == T_FIXNUM || atom_type(a) == T_BIGNUM)
+#define is_number(a) (atom_type(a) == T_NUM || is_integer(a))
+#define is_port(a) (atom_type(a) == T_INPUT || atom_type(a) == T_INPUT_PIPE || atom_type(a) == T_OUTPUT)
+
+/* The name of a symbol atom follows its header. Symbols no atom refers
+   to are freed by major collections. */
+struct symbol {
+	size_t hash; /* of the name, for interning; the number of a uniq symbol */
+	char mark; /* set from creation until the next major collection */
+	char permanent; /* held by a C global */
+	char uninterned; /* made by uniq, named when first printed */
+	char name[];
+};
+#define symbol_of(s) ((struct symbol *)((s) - offsetof(struct symbol, name)))
+
+/* len bytes, which may include NULs, and a NUL after them for C. Strings
+   shorter than STR_INLINE are stored in the header. A slice shares the
+   bytes of a hidden parent string and may have no NUL of its own. */
+#define STR_INLINE 16
 struct str {
-	char *value;
-	char mark;
-	struct str *next;
+	char *value; /* small, allocated, or in parent */
+	uint32_t len;
+	uint32_t capacity; /* bytes allocated for value, 0 when inline or a slice */
+	union {
+		char small[STR_INLINE];
+		struct str *parent; /* of a slice */
+	};
 };
+#define str_slice(s) ((s)->capacity == 0 && (s)->value != (s)->small)
+
+/* Sign and magnitude, in base 2^32 digits from the least significant,
+   without leading zeros. Immutable. */
+struct bignum {
+	uint32_t *digit;
+	uint32_t size;
+	int sign; /* 1 or -1 */
+};
+
+/* 10^(9 2^k) and floor(B^2m / p) for its m digits, B = 2^32, which turns
+   division by it into multiplication */
+struct big_power {
+	uint32_t *digit, *inverse;
+	size_t size, inverse_size;
+};
+#define KARATSUBA_THRESHOLD 32 /* digits from which multiplication splits the factors */
+#define BIG_CONVERT_THRESHOLD 64 /* digits from which decimal conversion splits the number */
+#define BIG_MAX_DIGITS (1 << 24) /* of a power computed exactly */
 
 struct table_entry {
-	struct atom k, v;
+	atom k, v;
 	struct table_entry *next;
 };
 
+/* Entries of weak tables are dropped when their weak side dies. A value
+   of a weak-keys table is kept alive only through its key. */
+enum { TABLE_STRONG, TABLE_WEAK_KEYS, TABLE_WEAK_VALUES };
+
 struct table {
 	size_t capacity;
 	size_t size;
 	struct table_entry **data;
-	char mark;
-	struct table *next;
+	int weak;
+};
+
+/* Objects are allocated from SLAB_SIZE-aligned slabs of equally sized slots,
+   so the slab of an object is found by masking its address.
+   Collected classes have power-of-two slots and keep their mark bits in
+   bitmaps in the slab header, so marking does not write to the objects. */
+#define SLAB_SIZE 65536
+#define ARENA_SIZE (64 * SLAB_SIZE)
+#define SLAB_WORDS (SLAB_SIZE / 16 / 64) /* bitmap words for 16-byte slots */
+#define SLAB_START ((sizeof(struct slab) + 63) & ~(size_t)63)
+#define slab_of(p) ((struct slab *)((uintptr_t)(p) & ~(uintptr_t)(SLAB_SIZE - 1)))
+#define slab_object(s, i) ((char *)(s) + SLAB_START + (i) * (s)->cls->size)
+#define slab_index(s, p) ((size_t)((char *)(p) - ((char *)(s) + SLAB_START)) >> (s)->cls->shift)
+
+#define bit_test(map, i) (((map)[(i) >> 6] >> ((i) & 63)) & 1)
+#define bit_set(map, i) ((map)[(i) >> 6] |= (uint64_t)1 << ((i) & 63))
+#define bit_clear(map, i) ((map)[(i) >> 6] &= ~((uint64_t)1 << ((i) & 63)))
+
+struct slab_class {
+	size_t size; /* slot size */
+	int collected; /* swept by the collector, otherwise freed explicitly */
+	void (*finalize)(void *obj);
+	int shift; /* log2 of the slot size of collected classes */
+	size_t count; /* slots per slab */
+	struct slab *slabs, *avail, *dirty;
+	struct slab *pending; /* slabs to sweep before allocating new ones */
+	struct slab *swept; /* swept by the sweeper thread, not available yet */
+};
+
+struct slab {
+	struct slab *next; /* all slabs of the class */
+	struct slab *next_avail; /* slabs with free slots */
+	struct slab *next_dirty; /* slabs allocated from since the last collection */
+	struct slab *next_pending; /* slabs not swept since the last collection */
+	struct slab_class *cls;
+	void *free;
+	size_t live;
+	char avail, dirty;
+	char unswept; /* marked by the last collection but not swept yet */
+	char pending; /* in the pending list of the class */
+	char pinned; /* not moved by the compacting collector */
+	uint32_t *sites; /* allocation sites of the objects, when profiling */
+	uint64_t alloc[SLAB_WORDS];
+	uint64_t mark[SLAB_WORDS]; /* old objects stay marked between collections */
+	uint64_t remembered[SLAB_WORDS]; /* old objects recorded by the write barrier */
+};
+
+#ifdef GC_PARALLEL
+/* A marking thread. Its gray objects are private to it, except for the
+   shared ones, which other threads may steal. */
+struct gc_worker {
+	pthread_t thread;
+	atom *gray;
+	size_t gray_size, gray_capacity;
+	pthread_mutex_t lock; /* of shared */
+	atom *shared;
+	size_t shared_size, shared_capacity;
+	size_t marked_payload;
+};
+#endif
+
+/* live objects of one class allocated by an Arc function */
+struct heap_site {
+	char *name;
+	size_t count[5], bytes[5]; /* pairs, strings, tables, ports and bignums */
+};
+
+/* Objects reachable from the roots, numbered in the order found. */
+struct heap_dump {
+	atom *objects;
+	size_t count, capacity;
+	void **keys; /* hash of the objects, open addressing */
+	uint32_t *ids;
+	size_t key_capacity;
+	const char **root_names;
+	size_t *root_ids;
+	size_t root_count, root_capacity;
 };
 
 /* simple string with length and capacity */
@@ -103,18 +328,52 @@ struct string {
 	size_t len, cap;
 };
 
+/* Atoms that C code holds across calls that may collect. Frames live on
+   the C stack and are linked from roots. Unused slots are NULL. */
+#define ROOT_SLOTS 3
+struct root_frame {
+	struct root_frame *prev;
+	atom *atoms[ROOT_SLOTS];
+	struct vector *vector;
+};
+extern struct root_frame *roots;
+extern char *gc_stack_bottom;
+void root_frame_push(struct root_frame *f);
+#define root_frame_pop(f) (roots = (f)->prev)
+
 /* forward declarations */
 error apply(atom fn, struct vector *vargs, atom *result);
 int listp(atom expr);
 char *slurp_fp(FILE *fp);
 char *slurp(const char *path);
 error eval_expr(atom expr, atom env, atom *result);
+void slab_sweep(struct slab *s, int clear);
 void gc_mark(atom root);
+void gc_drain();
 void gc();
+void gc_minor();
+void gc_write_barrier(atom obj);
+void gc_begin_cycle();
+size_t gc_step();
+void gc_shade(atom a);
+void gray_push(atom a);
+void *heap_object(atom a);
+int gc_marked(void *p);
+void gc_account(void *obj, size_t bytes);
+int gc_reserve(size_t bytes);
+int parse_size(const char *s, size_t *result);
+int gc_option(const char *opt);
+void heap_profile_dump();
+int heap_dump(const char *path);
+void symbol_rehash(struct symbol **syms, size_t n, size_t capacity);
+atom make_bignum(int sign, uint32_t *digit, size_t n);
+char *symbol_name(char *s);
 error macex(atom expr, atom *result);
 char *to_string(atom a, int write);
 void string_new(struct string* dst);
 void string_cat(struct string *dst, char *src);
+void string_append(struct string *dst, const char *src, size_t len);
+void string_print(struct string *s, atom a, int write);
 error macex_eval(atom expr, atom *result);
 error arc_load_file(const char *path);
 char *get_dir_path(char *file_path);
@@ -139,9 +398,35 @@ void consider_gc();
 atom cons(atom car_val, atom cdr_val);
 /* end forward */
 
-#define car(p) ((p).value.pair->car)
-#define cdr(p) ((p).value.pair->cdr)
-#define no(atom) ((atom).type == T_NIL)
+/* number of young objects allocated between minor collections */
+#ifndef GC_NURSERY_SIZE
+#define GC_NURSERY_SIZE 16384
+#endif
+/* number of allocations between slices of the incremental collector */
+#ifndef GC_SLICE_ALLOC
+#define GC_SLICE_ALLOC 1024
+#endif
+/* heap growth in bytes that also starts a slice */
+#ifndef GC_SLICE_BYTES
+#define GC_SLICE_BYTES (1 << 20)
+#endif
+/* gray stack entries kept after a major collection */
+#ifndef GC_GRAY_KEEP
+#define GC_GRAY_KEEP 65536
+#endif
+/* gray objects a marking thread shares at a time */
+#ifndef GC_STEAL_CHUNK
+#define GC_STEAL_CHUNK 64
+#endif
+/* bytes for the name of an uninterned symbol */
+#define UNIQ_NAME_SIZE 32
+/* smallest capacity of the symbol table */
+#ifndef SYMBOL_MIN_CAPACITY
+#define SYMBOL_MIN_CAPACITY 1024
+#endif
+
+#define car(p) (atom_pair(p)->car)
+#define cdr(p) (atom_pair(p)->cdr)
 
 extern const atom nil;
 
@@ -7,6 +7,10 @@ void print_logo() {
 
 void repl() {
 	struct string input;
+	atom expr = nil;
+	struct root_frame frame; /* expr is printed after an error */
+	root_frame_push(&frame);
+	frame.atoms[0] = &expr;
 
 	while ((input.str = readline("> ")) != NULL) {
 		input.cap = (input.len = strlen(input.str)) + 1;
@@ -15,7 +19,6 @@ void repl() {
 		const char *p = input.str;
 		error err;
 
-		atom expr;
 		err = read_expr(p, &p, &expr);
 		if (err == ERROR_FILE) { /* read more lines */
 			char *line = readline("  ");
@@ -55,38 +58,94 @@ void repl() {
 		}
 		free(input.str);
 	}
+	root_frame_pop(&frame);
+}
+
+/* ARCADIA_GC holds collector options separated by spaces or commas,
+   e.g. "growth=1.5,min-heap=64M". Options on the command line override it. */
+int env_gc_options() {
+	char *opts = getenv("ARCADIA_GC"), *opt;
+	if (!opts) return 1;
+	opts = strdup(opts);
+	for (opt = strtok(opts, " ,"); opt; opt = strtok(NULL, " ,")) {
+		if (!gc_option(opt)) {
+			fprintf(stderr, "Invalid option in ARCADIA_GC: %s\n", opt);
+			free(opts);
+			return 0;
+		}
+	}
+	free(opts);
+	return 1;
 }
 
 int main(int argc, char **argv)
 {
-	if (argc == 1) { /* REPL */
-		print_logo();
-		arc_init(argv[0]);
-		repl();
-		puts("");
-		return 0;
-	}
-	else if (argc == 2) {
-		char *opt = argv[1];
+	int i;
+	gc_stack_bottom = (char *)&i;
+	if (!env_gc_options()) return 1;
+	for (i = 1; i < argc; i++) {
+		char *opt = argv[i];
 		if (strcmp(opt, "-h") == 0) {
 			puts("Usage: arcadia [OPTIONS...] [FILES...]");
 			puts("");
 			puts("OPTIONS:");
 			puts("    -h    print this screen.");
 			puts("    -v    print version.");
+			puts("    --gc-mode=generational|incremental|compacting");
+			puts("          select the garbage collector. (default: generational)");
+			puts("          compacting also copies lists together on major collections.");
+			puts("    --gc-threads=N");
+			puts("          threads marking in major collections. (default: 1)");
+			puts("    --gc-sweep=lazy|background");
+			puts("          sweep on allocation or in a thread. (default: lazy)");
+			puts("    --gc-huge-pages=on|off");
+			puts("          back the heap with transparent huge pages. (default: off)");
+			puts("    --gc-budget=N");
+			puts("          least objects marked or swept per incremental slice. (default: 10000)");
+			puts("    --gc-pause=USEC");
+			puts("          time limit of an incremental slice. (default: 0, no limit)");
+			puts("    --gc-growth=X");
+			puts("          heap growth that starts a major collection. (default: 2)");
+			puts("    --gc-min-heap=SIZE");
+			puts("          heap size below which no major collection starts. (default: 4M)");
+			puts("    --max-heap=SIZE");
+			puts("          heap size that raises an out of memory error. (default: 0, no limit)");
+			puts("    --heap-profile=FILE");
+			puts("          write the live objects by allocating function to FILE");
+			puts("          after each major collection.");
+			puts("");
+			puts("ENVIRONMENT:");
+			puts("    ARCADIA_GC    --gc- options without the prefix, e.g. \"growth=1.5,min-heap=64M\"");
 			return 0;
 		}
 		else if (strcmp(opt, "-v") == 0) {
 			puts(VERSION);
 			return 0;
 		}
+		else if (strncmp(opt, "--gc-", 5) == 0 || strncmp(opt, "--max-heap=", 11) == 0
+			|| strncmp(opt, "--heap-profile=", 15) == 0) {
+			if (!gc_option(opt + (opt[2] == 'g' ? 5 : 2))) {
+				fprintf(stderr, "Invalid option: %s\n", opt);
+				return 1;
+			}
+		}
+		else {
+			break;
+		}
+	}
+
+	if (i == argc) { /* REPL */
+		print_logo();
+		arc_init(argv[0]);
+		repl();
+		puts("");
+		return 0;
 	}
 
 	/* execute files */
 	arc_init(argv[0]);
-	int i;
 	error err;
-	for (i = 1; i < argc; i++) {
+	for (; i < argc; i++) {
 		err = arc_load_file(argv[i]);
 		if (err) {
 			fprintf(stderr, "In file %s:\n", argv[i]);
@@ -0,0 +1,281 @@
+/* heapstat: reports the objects that retain the most memory in a heap dump
+   written by (dump-heap "file") or SIGUSR1.
+   Usage: heapstat FILE [N] */
+
+#include "arc.h"
+
+struct root {
+	char *name;
+	size_t id;
+};
+
+unsigned char *buf, *pos, *buf_end;
+size_t object_count, root_count;
+struct root *roots_of_dump;
+unsigned char *types;
+size_t *sizes;
+size_t *edge_start, *edges; /* edges of object i are edge_start[i] to edge_start[i + 1] */
+
+int read_varint(size_t *result)
+{
+	size_t n = 0;
+	int shift = 0;
+	while (pos < buf_end) {
+		unsigned char c = *pos++;
+		n |= (size_t)(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			*result = n;
+			return 1;
+		}
+		shift += 7;
+	}
+	return 0;
+}
+
+int read_dump(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	size_t len, i, j, n, capacity;
+	if (!fp) return 0;
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	buf = malloc(len);
+	if (fread(buf, 1, len, fp) != len) {
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	pos = buf;
+	buf_end = buf + len;
+	if (len < 8 || memcmp(buf, "ARCHEAP1", 8) != 0) return 0;
+	pos += 8;
+	if (!read_varint(&root_count)) return 0;
+	roots_of_dump = malloc(root_count * sizeof(struct root));
+	for (i = 0; i < root_count; i++) {
+		if (!read_varint(&n) || (size_t)(buf_end - pos) < n) return 0;
+		roots_of_dump[i].name = malloc(n + 1);
+		memcpy(roots_of_dump[i].name, pos, n);
+		roots_of_dump[i].name[n] = 0;
+		pos += n;
+		if (!read_varint(&roots_of_dump[i].id)) return 0;
+	}
+	if (!read_varint(&object_count)) return 0;
+	types = malloc(object_count + 1);
+	sizes = malloc((object_count + 1) * sizeof(size_t));
+	edge_start = malloc((object_count + 2) * sizeof(size_t));
+	capacity = object_count * 2 + 16;
+	edges = malloc(capacity * sizeof(size_t));
+	n = 0;
+	for (i = 0; i < object_count; i++) {
+		size_t count;
+		if (pos >= buf_end) return 0;
+		types[i] = *pos++;
+		if (!read_varint(&sizes[i]) || !read_varint(&count)) return 0;
+		edge_start[i] = n;
+		if (n + count > capacity) {
+			capacity = (n + count) * 2;
+			edges = realloc(edges, capacity * sizeof(size_t));
+		}
+		for (j = 0; j < count; j++) {
+			if (!read_varint(&edges[n]) || edges[n] >= object_count) return 0;
+			n++;
+		}
+	}
+	/* a virtual root, numbered object_count, points to the roots */
+	types[object_count] = T_NIL;
+	sizes[object_count] = 0;
+	edge_start[object_count] = n;
+	if (n + root_count > capacity) edges = realloc(edges, (n + root_count) * sizeof(size_t));
+	for (i = 0; i < root_count; i++) {
+		if (roots_of_dump[i].id >= object_count) return 0;
+		edges[n++] = roots_of_dump[i].id;
+	}
+	edge_start[object_count + 1] = n;
+	return 1;
+}
+
+/* Lengauer-Tarjan, in depth-first numbers. */
+size_t *dfnum, *vertex, *parent, *semi, *idom, *ancestor, *label;
+size_t reached;
+
+/* Path compression without recursion, since a long list makes a path
+   as long as the list. */
+size_t eval(size_t v, size_t *stack)
+{
+	size_t top = 0, u = v;
+	if (ancestor[v] == (size_t)-1) return v;
+	while (ancestor[ancestor[u]] != (size_t)-1) {
+		stack[top++] = u;
+		u = ancestor[u];
+	}
+	while (top) {
+		size_t x = stack[--top], a = ancestor[x];
+		if (semi[label[a]] < semi[label[x]]) label[x] = label[a];
+		ancestor[x] = ancestor[a];
+	}
+	return label[v];
+}
+
+void dominators()
+{
+	size_t n = object_count + 1, i, top, *stack, *next_edge;
+	size_t *pred_start, *preds, *bucket_head, *bucket_next;
+	dfnum = malloc(n * sizeof(size_t));
+	vertex = malloc(n * sizeof(size_t));
+	parent = malloc(n * sizeof(size_t));
+	stack = malloc(n * sizeof(size_t));
+	next_edge = malloc(n * sizeof(size_t));
+	for (i = 0; i < n; i++) dfnum[i] = (size_t)-1;
+
+	/* depth-first numbering from the virtual root */
+	reached = 0;
+	top = 0;
+	dfnum[object_count] = reached;
+	vertex[reached++] = object_count;
+	parent[0] = (size_t)-1;
+	stack[top++] = object_count;
+	next_edge[object_count] = edge_start[object_count];
+	while (top) {
+		size_t v = stack[top - 1];
+		if (next_edge[v] == edge_start[v + 1]) {
+			top--;
+			continue;
+		}
+		size_t w = edges[next_edge[v]++];
+		if (dfnum[w] != (size_t)-1) continue;
+		dfnum[w] = reached;
+		parent[reached] = dfnum[v];
+		vertex[reached++] = w;
+		next_edge[w] = edge_start[w];
+		stack[top++] = w;
+	}
+
+	/* predecessors of the reached objects, in depth-first numbers */
+	pred_start = calloc(reached + 1, sizeof(size_t));
+	for (i = 0; i < reached; i++) {
+		size_t v = vertex[i], e;
+		for (e = edge_start[v]; e < edge_start[v + 1]; e++) pred_start[dfnum[edges[e]] + 1]++;
+	}
+	for (i = 0; i < reached; i++) pred_start[i + 1] += pred_start[i];
+	preds = malloc((pred_start[reached] + 1) * sizeof(size_t));
+	memcpy(next_edge, pred_start, reached * sizeof(size_t));
+	for (i = 0; i < reached; i++) {
+		size_t v = vertex[i], e;
+		for (e = edge_start[v]; e < edge_start[v + 1]; e++) preds[next_edge[dfnum[edges[e]]]++] = i;
+	}
+
+	semi = malloc(reached * sizeof(size_t));
+	idom = malloc(reached * sizeof(size_t));
+	ancestor = malloc(reached * sizeof(size_t));
+	label = malloc(reached * sizeof(size_t));
+	bucket_head = malloc(reached * sizeof(size_t));
+	bucket_next = malloc(reached * sizeof(size_t));
+	for (i = 0; i < reached; i++) {
+		semi[i] = label[i] = i;
+		ancestor[i] = bucket_head[i] = (size_t)-1;
+	}
+	for (i = reached; i-- > 1;) {
+		size_t p, v, e;
+		for (e = pred_start[i]; e < pred_start[i + 1]; e++) {
+			size_t u = eval(preds[e], stack);
+			if (semi[u] < semi[i]) semi[i] = semi[u];
+		}
+		bucket_next[i] = bucket_head[semi[i]];
+		bucket_head[semi[i]] = i;
+		p = parent[i];
+		ancestor[i] = p;
+		for (v = bucket_head[p]; v != (size_t)-1; v = bucket_next[v]) {
+			size_t u = eval(v, stack);
+			idom[v] = semi[u] < semi[v] ? u : p;
+		}
+		bucket_head[p] = (size_t)-1;
+	}
+	idom[0] = 0;
+	for (i = 1; i < reached; i++) {
+		if (idom[i] != semi[i]) idom[i] = idom[idom[i]];
+	}
+	free(stack);
+	free(next_edge);
+	free(pred_start);
+	free(preds);
+	free(bucket_head);
+	free(bucket_next);
+}
+
+const char *type_name(int type)
+{
+	switch (type) {
+	case T_CONS: return "pair";
+	case T_CLOSURE: return "closure";
+	case T_MACRO: return "macro";
+	case T_STRING: return "string";
+	case T_TABLE: return "table";
+	case T_INPUT: return "input";
+	case T_INPUT_PIPE: return "input-pipe";
+	case T_OUTPUT: return "output";
+	case T_BIGNUM: return "bignum";
+	default: return "?";
+	}
+}
+
+size_t *retained;
+
+int retained_compare(const void *a, const void *b)
+{
+	size_t x = retained[*(const size_t *)a], y = retained[*(const size_t *)b];
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	size_t i, n, top = 20, total = 0, *order, *root_name_of, count[T_BIGNUM + 1] = { 0 }, bytes[T_BIGNUM + 1] = { 0 };
+	if (argc < 2) {
+		fputs("Usage: heapstat FILE [N]\n", stderr);
+		return 1;
+	}
+	if (argc > 2) top = strtoul(argv[2], NULL, 10);
+	if (!read_dump(argv[1])) {
+		fprintf(stderr, "Cannot read heap dump %s\n", argv[1]);
+		return 1;
+	}
+	dominators();
+
+	/* idom numbers are smaller than their children's */
+	retained = malloc(reached * sizeof(size_t));
+	for (i = 0; i < reached; i++) retained[i] = sizes[vertex[i]];
+	for (i = reached; i-- > 1;) retained[idom[i]] += retained[i];
+	for (i = 1; i < reached; i++) {
+		int t = types[vertex[i]];
+		count[t]++;
+		bytes[t] += sizes[vertex[i]];
+		total += sizes[vertex[i]];
+	}
+	printf("%zu objects, %zu bytes reachable\n\n", reached - 1, total);
+	printf("%14s %10s  type\n", "bytes", "count");
+	for (i = 0; i <= T_BIGNUM; i++) {
+		if (count[i]) printf("%14zu %10zu  %s\n", bytes[i], count[i], type_name((int)i));
+	}
+
+	/* name each object dominated by the virtual root after its root */
+	root_name_of = malloc(reached * sizeof(size_t));
+	for (i = 0; i < reached; i++) root_name_of[i] = (size_t)-1;
+	for (i = root_count; i-- > 0;) root_name_of[dfnum[roots_of_dump[i].id]] = i;
+
+	/* the rest of a list is part of its first pair */
+	order = malloc(reached * sizeof(size_t));
+	n = 0;
+	for (i = 1; i < reached; i++) {
+		if (idom[i] != 0 && types[vertex[idom[i]]] == T_CONS && types[vertex[i]] == T_CONS) continue;
+		order[n++] = i;
+	}
+	qsort(order, n, sizeof(size_t), retained_compare);
+	printf("\n%14s %14s %8s %10s  retained by\n", "retained", "self", "type", "id");
+	for (i = 0; i < top && i < n; i++) {
+		size_t v = order[i], r = v;
+		while (idom[r] != 0) r = idom[r];
+		printf("%14zu %14zu %8s %10zu  %s%s\n", retained[v], sizes[vertex[v]], type_name(types[vertex[v]]), vertex[v],
+			root_name_of[r] == (size_t)-1 ? "(shared)" : roots_of_dump[root_name_of[r]].name, r == v ? "" : " ...");
+	}
+	return 0;
+}
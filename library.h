@@ -98,9 +98,6 @@ const char* stdlib = "(mac = args (cons 'assign args))\n"
 "        (apply join (cdr args))\n"
 "        (cons (car a) (apply join (cons (cdr a) (cdr args))))))))\n"
 "\n"
-"(= uniq (let uniq-count 0\n"
-"  (fn () (sym (string \"_uniq\" (= uniq-count (+ uniq-count 1)))))))\n"
-"\n"
 "(mac w/uniq (names . body)\n"
 "  (if (isa names 'cons)\n"
 "    `(with ,(apply join (map1 (fn (x) (list x '(uniq))) names))\n"
@@ -243,7 +240,7 @@ const char* stdlib = "(mac = args (cons 'assign args))\n"
 "\n"
 "(def number (n)\n"
 "  \"Is 'n' a number?\"\n"
-"  (is (type n) 'num))\n"
+"  (or (is (type n) 'int) (is (type n) 'num)))\n"
 "\n"
 "(def positive (x)\n"
 "  (and (number x) (> x 0)))\n"
@@ -814,9 +811,11 @@ const char* stdlib = "(mac = args (cons 'assign args))\n"
 "\"Extract a chunk of 'seq' from index 'start' (inclusive) to 'end' (exclusive). 'end'\n"
 "can be left out or nil to indicate everything from 'start', and can be\n"
 "negative to count backwards from the end.\"\n"
-"  (firstn (- (range-bounce end len.seq)\n"
-"             start)\n"
-"          (nthcdr start seq)))\n"
+"  (if (isa seq 'string)\n"
+"      (substring seq start (range-bounce end len.seq))\n"
+"      (firstn (- (range-bounce end len.seq)\n"
+"                 start)\n"
+"              (nthcdr start seq))))\n"
 "\n"
 "(def split (seq pos)\n"
 "  \"Partitions 'seq' at index 'pos'.\"\n"